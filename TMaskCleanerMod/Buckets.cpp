@@ -0,0 +1,265 @@
+#include <map>
+#include <mutex>
+#include <thread>
+#include "shared.h"
+
+// Labelling of one source frame, shared by every bucket output of that frame.
+struct BucketLabels {
+	std::mutex lock;
+	bool ready = false;
+	CCLContext ctx;
+	// buckets that have written this frame, it leaves the cache once all have
+	int served = 0;
+};
+
+struct BucketsData {
+	VSNode* node;
+	const VSVideoInfo* vi;
+	TMCData params;
+	int mode;
+	// lengths[i - 1] <= value < lengths[i] selects bucket i
+	std::vector<int64_t> lengths;
+	void (*process)(const VSFrame*, VSFrame*, int, int, const BucketsData*, BucketLabels&, const VSAPI*);
+
+	std::mutex cache_lock;
+	std::map<int, std::shared_ptr<BucketLabels>> cache;
+	size_t max_cached;
+
+	size_t num_buckets() const { return lengths.size() + 1; }
+};
+
+// Instance data of one output clip.
+struct BucketOutput {
+	std::shared_ptr<BucketsData> shared;
+	int bucket;
+};
+
+// Fade factor of a component in bucket, negative when it belongs to another
+// one. The lower edge fades like TMaskCleanerMod's length, the first bucket
+// has no lower edge and never fades.
+static double bucket_factor(size_t value, int bucket, const std::vector<int64_t>& lengths, unsigned int fade, double fade_inv) {
+	if (bucket < static_cast<int>(lengths.size()) && static_cast<int64_t>(value) >= lengths[bucket])
+		return -1.0;
+	if (bucket == 0)
+		return 1.0;
+	return component_factor<false>(value, static_cast<unsigned int>(lengths[bucket - 1]), fade, fade_inv);
+}
+
+template<bool binarize, typename pixel_t>
+static void process_bucket(const VSFrame* src, VSFrame* dst, int bits, int bucket, const BucketsData* d, BucketLabels& labels, const VSAPI* vsapi) {
+	const pixel_t* srcptr = reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(src, 0));
+	pixel_t* VS_RESTRICT dstptr = reinterpret_cast<pixel_t*>(vsapi->getWritePtr(dst, 0));
+	const int srcStride = vsapi->getStride(src, 0) / sizeof(pixel_t);
+	int height = vsapi->getFrameHeight(src, 0);
+	int width = vsapi->getFrameWidth(src, 0);
+	const TMCData* p = &d->params;
+
+	thread_local std::vector<double> fade_factors;
+
+	/* the first bucket of a frame to get here labels it, the others wait for it */
+	{
+		std::lock_guard<std::mutex> guard(labels.lock);
+		if (!labels.ready) {
+			labels.ctx.kernels = p->kernels;
+			labels.ctx.pool = p->pool.get();
+			ccl_label<pixel_t>(labels.ctx, srcptr, srcStride, width, height, p->get_thresh<pixel_t>(), p->dir_count == 8, p->threads);
+			/* only the runs and stats are written back from */
+			labels.ctx.scratch.bitmap = Bitmap();
+			labels.ctx.scratch.strip_runs.clear();
+			labels.ready = true;
+		}
+	}
+
+	/* each bucket has its own factors, so the shared context's are left alone */
+	const CCLContext& ctx = labels.ctx;
+	const double fade_inv = p->fade > 0 ? 1.0f / p->fade : 0.0f;
+	fade_factors.resize(ctx.num_components);
+	for (size_t label = 0; label < ctx.num_components; ++label) {
+		fade_factors[label] = bucket_factor(component_value(d->mode, ctx.stats()[label]), bucket, d->lengths, p->fade, fade_inv);
+	}
+
+	write_components<binarize, pixel_t>(*ctx.kernels, srcptr, dstptr, srcStride, width, bits, ctx.scratch, fade_factors.data(), ctx.pool);
+	trim_capacity(fade_factors, fade_factors.size());
+}
+
+// Cache entry of frame n, created when missing. The lowest frame numbers are
+// dropped first when outputs that are never requested let entries pile up.
+static std::shared_ptr<BucketLabels> acquireLabels(BucketsData* d, int n) {
+	std::lock_guard<std::mutex> guard(d->cache_lock);
+	auto& entry = d->cache[n];
+	if (!entry) {
+		entry = std::make_shared<BucketLabels>();
+		while (d->cache.size() > d->max_cached) {
+			d->cache.erase(d->cache.begin()->first != n ? d->cache.begin() : std::next(d->cache.begin()));
+		}
+	}
+	return entry;
+}
+
+static void releaseLabels(BucketsData* d, int n, const std::shared_ptr<BucketLabels>& labels) {
+	std::lock_guard<std::mutex> guard(d->cache_lock);
+	if (++labels->served < static_cast<int>(d->num_buckets()))
+		return;
+	auto it = d->cache.find(n);
+	if (it != d->cache.end() && it->second == labels)
+		d->cache.erase(it);
+}
+
+static const VSFrame* VS_CC BucketsGetFrame(int n, int activationReason, void* instanceData, void** frameData, VSFrameContext* frameCtx, VSCore* core, const VSAPI* vsapi) {
+	BucketOutput* out = static_cast<BucketOutput*>(instanceData);
+	BucketsData* d = out->shared.get();
+
+	if (activationReason == arInitial) {
+		vsapi->requestFrameFilter(n, d->node, frameCtx);
+	}
+	else if (activationReason == arAllFramesReady) {
+		const VSFrame* src = vsapi->getFrameFilter(n, d->node, frameCtx);
+		const VSVideoFormat* fi = vsapi->getVideoFrameFormat(src);
+		int height = vsapi->getFrameHeight(src, 0);
+		int width = vsapi->getFrameWidth(src, 0);
+		const VSFrame* fr[] = { nullptr, src, src };
+		const int pl[] = { 0, 1, 2 };
+		VSFrame* dst = vsapi->newVideoFrame2(fi, width, height, fr, pl, src, core);
+		int bits = d->vi->format.bitsPerSample;
+
+		try {
+			const auto labels = acquireLabels(d, n);
+			d->process(src, dst, bits, out->bucket, d, *labels, vsapi);
+			releaseLabels(d, n, labels);
+		}
+		catch (const std::exception& e) {
+			vsapi->setFilterError((std::string("Buckets error: ") + e.what()).c_str(), frameCtx);
+			vsapi->freeFrame(dst);
+			dst = nullptr;
+		}
+
+		vsapi->freeFrame(src);
+		return dst;
+	}
+	return nullptr;
+}
+
+static void VS_CC BucketsFree(void* instanceData, VSCore* core, const VSAPI* vsapi) {
+	delete static_cast<BucketOutput*>(instanceData);
+}
+
+void VS_CC BucketsCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core, const VSAPI* vsapi) {
+	/* the last output to go frees the source */
+	std::shared_ptr<BucketsData> d(new BucketsData(), [vsapi](BucketsData* d) {
+		vsapi->freeNode(d->node);
+		delete d;
+	});
+	TMCData* p = &d->params;
+	int err{ 0 };
+
+	d->node = vsapi->mapGetNode(in, "clip", 0, nullptr);
+	d->vi = vsapi->getVideoInfo(d->node);
+
+	try {
+		if (!vsh::isConstantVideoFormat(d->vi) || (d->vi->format.sampleType == stInteger && d->vi->format.bitsPerSample > 16) || (d->vi->format.sampleType == stFloat && d->vi->format.bitsPerSample != 32))
+			throw std::string("only constant format 8-16 bits integer, and f32 input supported.");
+
+		const int num_lengths = vsapi->mapNumElements(in, "lengths");
+		for (int i = 0; i < num_lengths; ++i) {
+			d->lengths.push_back(vsapi->mapGetInt(in, "lengths", i, nullptr));
+		}
+
+		auto thresh = static_cast<float>(vsapi->mapGetFloat(in, "thresh", 0, &err));
+		if (err)
+			thresh = (d->vi->format.sampleType == stInteger) ? 235 << (d->vi->format.bitsPerSample - 8) : 1.0f;
+
+		if (d->vi->format.bytesPerSample == 1) {
+			p->set_thresh<uint8_t>(static_cast<uint8_t>(std::clamp(thresh, 0.0f, 255.0f)));
+		}
+		else if (d->vi->format.bytesPerSample == 2) {
+			p->set_thresh<uint16_t>(static_cast<uint16_t>(std::clamp(thresh, 0.0f, 65535.0f)));
+		}
+		else {
+			p->set_thresh<float>(thresh);
+		}
+
+		p->fade = static_cast<unsigned int>(vsapi->mapGetInt(in, "fade", 0, &err));
+		if (err)
+			p->fade = 0;
+
+		auto binarize = static_cast<bool>(vsapi->mapGetInt(in, "binarize", 0, &err));
+		if (err)
+			binarize = false;
+
+		auto connectivity = static_cast<unsigned int>(vsapi->mapGetInt(in, "connectivity", 0, &err));
+		if (err)
+			connectivity = 8;
+
+		d->mode = static_cast<int>(vsapi->mapGetInt(in, "mode", 0, &err));
+		if (err)
+			d->mode = 0;
+
+		p->threads = static_cast<int>(vsapi->mapGetInt(in, "threads", 0, &err));
+		if (err)
+			p->threads = 1;
+
+		auto opt = static_cast<int>(vsapi->mapGetInt(in, "opt", 0, &err));
+		if (err)
+			opt = -1;
+		if (opt < -1 || opt > cpuAVX512)
+			throw std::string("opt must be -1 (auto), 0 (scalar), 1 (sse4.1), 2 (avx2) or 3 (avx512).");
+		p->kernels = select_kernels(opt);
+		if (!p->kernels)
+			throw std::string("opt=" + std::to_string(opt) + " is not supported by this CPU.");
+
+		for (size_t i = 0; i < d->lengths.size(); ++i) {
+			if (d->lengths[i] <= 0 || d->lengths[i] > std::numeric_limits<unsigned int>::max())
+				throw std::string("lengths must be greater than zero.");
+			if (i > 0 && d->lengths[i] <= d->lengths[i - 1])
+				throw std::string("lengths must be strictly increasing.");
+		}
+
+		if (thresh <= 0 && d->vi->format.bytesPerSample < 4)
+			throw std::string("thresh must be greater than zero for 8-16bit clip.");
+
+		if (connectivity != 4 && connectivity != 8)
+			throw std::string("connectivity must be either 4 or 8.");
+
+		if (d->mode < 0 || d->mode > 8)
+			throw std::string("mode must be in the range [0, 8].");
+
+		if (p->threads < 1)
+			throw std::string("threads must be at least 1.");
+
+		p->dir_count = connectivity;
+		p->directions = connectivity == 4 ? directions4 : directions8;
+
+		// binarize, data_bytes - 1
+		int selector = (d->vi->format.bytesPerSample - 1) | (binarize << 2);
+
+		switch (selector) {
+		case 0b000: d->process = &process_bucket<false, uint8_t>; break;
+		case 0b001: d->process = &process_bucket<false, uint16_t>; break;
+		case 0b011: d->process = &process_bucket<false, float>; break;
+		case 0b100: d->process = &process_bucket<true, uint8_t>; break;
+		case 0b101: d->process = &process_bucket<true, uint16_t>; break;
+		case 0b111: d->process = &process_bucket<true, float>; break;
+		default: throw std::string("Unsupported combination of parameters");
+		}
+	}
+	catch (const std::string& error) {
+		vsapi->mapSetError(out, ("Buckets: " + error).c_str());
+		return;
+	}
+
+	createPool(p);
+
+	/* enough for every worker to be on a different frame */
+	d->max_cached = std::max<size_t>(16, 2 * std::thread::hardware_concurrency());
+
+	/* one filter per bucket, appended to the returned clip array */
+	for (size_t bucket = 0; bucket < d->num_buckets(); ++bucket) {
+		auto bucket_out{ std::make_unique<BucketOutput>() };
+		bucket_out->shared = d;
+		bucket_out->bucket = static_cast<int>(bucket);
+
+		VSFilterDependency deps[] = { {d->node, rpStrictSpatial} };
+		vsapi->createVideoFilter(out, "Buckets", d->vi, BucketsGetFrame, BucketsFree, fmParallel, deps, 1, bucket_out.get(), core);
+		bucket_out.release();
+	}
+}
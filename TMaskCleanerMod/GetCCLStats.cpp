@@ -1,32 +1,45 @@
 #include "shared.h"
 
-#define LABEL_CAPACITY 512
-
-template<typename pixel_t>
-void process_ccls(const VSFrame* src, VSFrame* dst, int bits, const TMCData* d, const VSAPI* vsapi) {
-	const pixel_t* srcptr = reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(src, 0));
-	const int srcStride = vsapi->getStride(src, 0) / sizeof(pixel_t);
-	int height = vsapi->getFrameHeight(src, 0);
-	int width = vsapi->getFrameWidth(src, 0);
-	VSMap* props = vsapi->getFramePropertiesRW(dst);
-
-	thread_local std::vector<uint8_t> lookup;
-	const size_t lookup_size = (height * width + 7) >> 3;
-	if (lookup.size() != lookup_size) {
-		lookup.resize(lookup_size, 0);
+// Components kept by min_area and max_labels (the largest by area, ties in
+// raster order), returned in raster order.
+static void selectComponents(const ComponentStats* stats, size_t num_components, int64_t min_area, int max_labels, std::vector<uint32_t>& kept) {
+	kept.clear();
+	for (size_t label = 0; label < num_components; ++label) {
+		if (stats[label].area >= min_area)
+			kept.push_back(static_cast<uint32_t>(label));
 	}
-	else {
-		std::fill(lookup.begin(), lookup.end(), 0);
+	if (max_labels > 0 && kept.size() > static_cast<size_t>(max_labels)) {
+		std::nth_element(kept.begin(), kept.begin() + max_labels, kept.end(), [stats](uint32_t a, uint32_t b) {
+			return stats[a].area > stats[b].area || (stats[a].area == stats[b].area && a < b);
+		});
+		kept.resize(max_labels);
+		std::sort(kept.begin(), kept.end());
 	}
+}
 
-	thread_local std::vector<Coordinates> coordinates;
-	coordinates.reserve(4096);
-
-	const auto& directions = d->directions;
-	const int dir_count = d->dir_count;
-	const auto thresh = d->get_thresh<pixel_t>();
+// Leads the _CCLStatsPacked blob, followed by num_labels entries per column:
+// areas, lefts, tops, widths, heights as int32, centroids_x, centroids_y as
+// float32, then a float64 column for each IntensityStat bit set in columns, in
+// the order sums, min, max, means, weighted centroids x and y.
+struct PackedStatsHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t num_labels;
+	uint32_t columns;
+};
+
+// Appends one column to the packed blob, converted to T.
+template<typename T, typename S>
+static void appendColumn(std::vector<uint8_t>& blob, const std::vector<S>& column, size_t count) {
+	const size_t offset = blob.size();
+	blob.resize(offset + count * sizeof(T));
+	for (size_t i = 0; i < count; ++i) {
+		const T value = static_cast<T>(column[i]);
+		memcpy(blob.data() + offset + i * sizeof(T), &value, sizeof(T));
+	}
+}
 
-	auto num_labels = 0;
+void setCCLStatsProps(const ComponentStats* stats, size_t num_components, const ComponentStats& background, const StatsOutput& out, VSMap* props, const VSAPI* vsapi) {
 	thread_local std::vector<int64_t> areas;
 	thread_local std::vector<int64_t> lefts;
 	thread_local std::vector<int64_t> tops;
@@ -34,111 +47,193 @@ void process_ccls(const VSFrame* src, VSFrame* dst, int bits, const TMCData* d,
 	thread_local std::vector<int64_t> heights;
 	thread_local std::vector<double> centroids_x;
 	thread_local std::vector<double> centroids_y;
-	areas.clear();
-	lefts.clear();
-	tops.clear();
-	widths.clear();
-	heights.clear();
-	centroids_x.clear();
-	centroids_y.clear();
-	if (areas.capacity() < LABEL_CAPACITY) {
-		areas.reserve(LABEL_CAPACITY);
-		lefts.reserve(LABEL_CAPACITY);
-		tops.reserve(LABEL_CAPACITY);
-		widths.reserve(LABEL_CAPACITY);
-		heights.reserve(LABEL_CAPACITY);
-		centroids_x.reserve(LABEL_CAPACITY);
-		centroids_y.reserve(LABEL_CAPACITY);
+	const size_t num_labels = out.labels(num_components);
+	areas.resize(num_labels);
+	lefts.resize(num_labels);
+	tops.resize(num_labels);
+	widths.resize(num_labels);
+	heights.resize(num_labels);
+	centroids_x.resize(num_labels);
+	centroids_y.resize(num_labels);
+
+	for (size_t i = 1; i < num_labels; ++i) {
+		const ComponentStats& c = stats[out.component(i)];
+		areas[i] = c.area;
+		lefts[i] = c.min_x + out.left;
+		tops[i] = c.min_y + out.top;
+		widths[i] = c.max_x - c.min_x + 1;
+		heights[i] = c.max_y - c.min_y + 1;
+		centroids_x[i] = static_cast<double>(c.sum_x) / c.area + out.left;
+		centroids_y[i] = static_cast<double>(c.sum_y) / c.area + out.top;
+	}
+
+	/* label 0 is the background, see ccl_background() */
+	const unsigned int bg_pixel_count = static_cast<unsigned int>(background.area);
+	areas[0] = bg_pixel_count;
+	lefts[0] = background.min_x + out.left;
+	tops[0] = background.min_y + out.top;
+	widths[0] = background.max_x - background.min_x + 1;
+	heights[0] = background.max_y - background.min_y + 1;
+	centroids_x[0] = static_cast<double>(background.sum_x) / bg_pixel_count + out.left;
+	centroids_y[0] = static_cast<double>(background.sum_y) / bg_pixel_count + out.top;
+
+	if (out.packed) {
+		appendColumn<int32_t>(*out.packed, areas, num_labels);
+		appendColumn<int32_t>(*out.packed, lefts, num_labels);
+		appendColumn<int32_t>(*out.packed, tops, num_labels);
+		appendColumn<int32_t>(*out.packed, widths, num_labels);
+		appendColumn<int32_t>(*out.packed, heights, num_labels);
+		appendColumn<float>(*out.packed, centroids_x, num_labels);
+		appendColumn<float>(*out.packed, centroids_y, num_labels);
 	}
+	else {
+		vsapi->mapSetIntArray(props, plane_key("_CCLStatAreas", out.plane).c_str(), areas.data(), areas.size());
+		vsapi->mapSetIntArray(props, plane_key("_CCLStatLefts", out.plane).c_str(), lefts.data(), lefts.size());
+		vsapi->mapSetIntArray(props, plane_key("_CCLStatTops", out.plane).c_str(), tops.data(), tops.size());
+		vsapi->mapSetIntArray(props, plane_key("_CCLStatWidths", out.plane).c_str(), widths.data(), widths.size());
+		vsapi->mapSetIntArray(props, plane_key("_CCLStatHeights", out.plane).c_str(), heights.data(), heights.size());
+		vsapi->mapSetFloatArray(props, plane_key("_CCLStatCentroids_x", out.plane).c_str(), centroids_x.data(), centroids_x.size());
+		vsapi->mapSetFloatArray(props, plane_key("_CCLStatCentroids_y", out.plane).c_str(), centroids_y.data(), centroids_y.size());
+	}
+	vsapi->mapSetInt(props, plane_key("_CCLStatNumLabels", out.plane).c_str(), num_labels, maReplace);
+
+	trim_capacity(areas, num_labels);
+	trim_capacity(lefts, num_labels);
+	trim_capacity(tops, num_labels);
+	trim_capacity(widths, num_labels);
+	trim_capacity(heights, num_labels);
+	trim_capacity(centroids_x, num_labels);
+	trim_capacity(centroids_y, num_labels);
+}
 
-	unsigned int bg_pixel_count = 0;
-	double bg_sum_x = 0.0, bg_sum_y = 0.0;
-	int bg_min_x = width, bg_max_x = -1;
-	int bg_min_y = height, bg_max_y = -1;
-
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			if (is_black<pixel_t>(srcptr[srcStride * y + x], thresh)) {
-				bg_pixel_count++;
-				bg_sum_x += x;
-				bg_sum_y += y;
-				bg_min_x = std::min(bg_min_x, x);
-				bg_max_x = std::max(bg_max_x, x);
-				bg_min_y = std::min(bg_min_y, y);
-				bg_max_y = std::max(bg_max_y, y);
-				continue;
+static void setIntensityProps(const ComponentStats* stats, const IntensityStats* intensity, size_t num_components, int64_t bg_area, const IntensityStats& background, unsigned which, bool float_values, const StatsOutput& out, VSMap* props, const VSAPI* vsapi) {
+	thread_local std::vector<int64_t> ints;
+	thread_local std::vector<double> floats;
+	const size_t num_labels = out.labels(num_components);
+
+	/* label 0 is the background, as in the geometry props */
+	auto area = [&](size_t label) { return label == 0 ? bg_area : stats[out.component(label)].area; };
+	auto at = [&](size_t label) -> const IntensityStats& { return label == 0 ? background : intensity[out.component(label)]; };
+
+	auto set_values = [&](const std::string& key, auto&& value) {
+		if (out.packed) {
+			floats.resize(num_labels);
+			for (size_t label = 0; label < num_labels; ++label) {
+				floats[label] = area(label) > 0 ? value(at(label)) : 0.0;
 			}
-			if (visited(x, y, width, lookup)) continue;
-
-			coordinates.clear();
-
-			unsigned int pixel_count = 1;
-			double sum_x = x, sum_y = y;
-			int min_x = x, max_x = x;
-			int min_y = y, max_y = y;
-
-			coordinates.emplace_back(x, y);
-			visit(x, y, width, lookup);
-
-			while (!coordinates.empty()) {
-				/* pop last coordinates */
-				Coordinates current = coordinates.back();
-				coordinates.pop_back();
-
-				for (int dir = 0; dir < dir_count; dir++) {
-					const int i = current.first + directions[dir].first;
-					const int j = current.second + directions[dir].second;
-
-					if (i < 0 || i >= width || j < 0 || j >= height) continue;
-					if (visited(i, j, width, lookup)) continue;
-					if (is_black<pixel_t>(srcptr[j * srcStride + i], thresh)) continue;
-
-					coordinates.emplace_back(i, j);
-					visit(i, j, width, lookup);
-
-					pixel_count++;
-					sum_x += i;
-					sum_y += j;
-					min_x = std::min(min_x, i);
-					max_x = std::max(max_x, i);
-					min_y = std::min(min_y, j);
-					max_y = std::max(max_y, j);
-				}
+			appendColumn<double>(*out.packed, floats, num_labels);
+		}
+		else if (float_values) {
+			floats.resize(num_labels);
+			for (size_t label = 0; label < num_labels; ++label) {
+				floats[label] = area(label) > 0 ? value(at(label)) : 0.0;
 			}
-
-			num_labels++;
-			areas.emplace_back(pixel_count);
-			lefts.emplace_back(min_x);
-			tops.emplace_back(min_y);
-			widths.emplace_back(max_x - min_x + 1);
-			heights.emplace_back(max_y - min_y + 1);
-			centroids_x.emplace_back(sum_x / pixel_count);
-			centroids_y.emplace_back(sum_y / pixel_count);
+			vsapi->mapSetFloatArray(props, key.c_str(), floats.data(), static_cast<int>(num_labels));
+		}
+		else {
+			ints.resize(num_labels);
+			for (size_t label = 0; label < num_labels; ++label) {
+				ints[label] = area(label) > 0 ? std::llround(value(at(label))) : 0;
+			}
+			vsapi->mapSetIntArray(props, key.c_str(), ints.data(), static_cast<int>(num_labels));
+		}
+	};
+
+	if (which & isSum)
+		set_values(plane_key("_CCLStatSums", out.plane), [](const IntensityStats& is) { return is.sum; });
+	if (which & isMin)
+		set_values(plane_key("_CCLStatMin", out.plane), [](const IntensityStats& is) { return is.min; });
+	if (which & isMax)
+		set_values(plane_key("_CCLStatMax", out.plane), [](const IntensityStats& is) { return is.max; });
+
+	floats.resize(num_labels);
+	if (which & isMean) {
+		for (size_t label = 0; label < num_labels; ++label) {
+			floats[label] = at(label).sum / area(label);
+		}
+		if (out.packed)
+			appendColumn<double>(*out.packed, floats, num_labels);
+		else
+			vsapi->mapSetFloatArray(props, plane_key("_CCLStatMeans", out.plane).c_str(), floats.data(), static_cast<int>(num_labels));
+	}
+	if (which & isCentroid) {
+		for (size_t label = 0; label < num_labels; ++label) {
+			floats[label] = at(label).sum_x / at(label).sum + out.left;
+		}
+		if (out.packed)
+			appendColumn<double>(*out.packed, floats, num_labels);
+		else
+			vsapi->mapSetFloatArray(props, plane_key("_CCLStatWeightedCentroids_x", out.plane).c_str(), floats.data(), static_cast<int>(num_labels));
+		for (size_t label = 0; label < num_labels; ++label) {
+			floats[label] = at(label).sum_y / at(label).sum + out.top;
 		}
+		if (out.packed)
+			appendColumn<double>(*out.packed, floats, num_labels);
+		else
+			vsapi->mapSetFloatArray(props, plane_key("_CCLStatWeightedCentroids_y", out.plane).c_str(), floats.data(), static_cast<int>(num_labels));
 	}
 
-	// get black pixels stat
-	num_labels++;
-	if (bg_pixel_count == 0) {
-		bg_min_x = 0;
-		bg_min_y = 0;
+	trim_capacity(ints, num_labels);
+	trim_capacity(floats, num_labels);
+}
+
+template<typename pixel_t>
+PlaneOutput process_ccls(const VSFrame* src, VSFrame* dst, VSMap* props, int plane, int bits, const TMCData* d, const FrameParams& fp, const VSAPI* vsapi) {
+	const pixel_t* srcptr = reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(src, plane));
+	const int srcStride = vsapi->getStride(src, plane) / sizeof(pixel_t);
+	int height = vsapi->getFrameHeight(src, plane);
+	int width = vsapi->getFrameWidth(src, plane);
+
+	/* the window is measured on its own, the props are moved by its origin */
+	if (d->roi.width > 0) {
+		srcptr += srcStride * d->roi.top + d->roi.left;
+		width = d->roi.width;
+		height = d->roi.height;
 	}
-	areas.emplace(areas.begin(), bg_pixel_count);
-	lefts.emplace(lefts.begin(), bg_min_x);
-	tops.emplace(tops.begin(), bg_min_y);
-	widths.emplace(widths.begin(), bg_max_x - bg_min_x + 1);
-	heights.emplace(heights.begin(), bg_max_y - bg_min_y + 1);
-	centroids_x.emplace(centroids_x.begin(), bg_sum_x / bg_pixel_count);
-	centroids_y.emplace(centroids_y.begin(), bg_sum_y / bg_pixel_count);
-
-	vsapi->mapSetIntArray(props, "_CCLStatAreas", areas.data(), areas.size());
-	vsapi->mapSetIntArray(props, "_CCLStatLefts", lefts.data(), lefts.size());
-	vsapi->mapSetIntArray(props, "_CCLStatTops", tops.data(), tops.size());
-	vsapi->mapSetIntArray(props, "_CCLStatWidths", widths.data(), widths.size());
-	vsapi->mapSetIntArray(props, "_CCLStatHeights", heights.data(), heights.size());
-	vsapi->mapSetFloatArray(props, "_CCLStatCentroids_x", centroids_x.data(), centroids_x.size());
-	vsapi->mapSetFloatArray(props, "_CCLStatCentroids_y", centroids_y.data(), centroids_y.size());
-	vsapi->mapSetInt(props, "_CCLStatNumLabels", num_labels, maReplace);
+
+	const auto thresh = fp.get_thresh<pixel_t>();
+
+	const unsigned which = d->intensity_stats;
+	constexpr bool float_values = std::is_floating_point_v<pixel_t>;
+
+	thread_local std::vector<uint32_t> kept;
+	thread_local std::vector<uint8_t> packed;
+	StatsOutput out;
+	out.plane = plane;
+	out.left = d->roi.left;
+	out.top = d->roi.top;
+	auto select = [&](const ComponentStats* stats, size_t num_components) {
+		if (d->min_area > 1 || d->max_labels > 0) {
+			selectComponents(stats, num_components, d->min_area, d->max_labels, kept);
+			out.kept = kept.data();
+			out.num_kept = kept.size();
+		}
+		if (d->packed_stats) {
+			packed.assign(sizeof(PackedStatsHeader), 0);
+			out.packed = &packed;
+		}
+		return out.labels(num_components);
+	};
+
+	thread_local CCLContext ctx;
+	ctx.kernels = d->kernels;
+	ctx.pool = d->pool.get();
+	const size_t num_components = ccl_stats<pixel_t>(ctx, srcptr, srcStride, width, height, thresh, d->dir_count == 8, d->threads, which);
+	const size_t num_labels = select(ctx.stats(), num_components);
+	setCCLStatsProps(ctx.stats(), num_components, ctx.background, out, props, vsapi);
+	if (which)
+		setIntensityProps(ctx.stats(), ctx.intensity_stats(), num_components, ctx.background.area, ctx.background_intensity, which, float_values, out, props, vsapi);
+	ctx.trim();
+
+	if (out.packed) {
+		const PackedStatsHeader header{ { 'C', 'C', 'L', 'S' }, 1, static_cast<uint32_t>(num_labels), which };
+		memcpy(packed.data(), &header, sizeof(header));
+		vsapi->mapSetData(props, plane_key("_CCLStatsPacked", out.plane).c_str(), reinterpret_cast<const char*>(packed.data()), static_cast<int>(packed.size()), dtBinary, maReplace);
+		trim_capacity(packed, packed.size());
+	}
+	trim_capacity(kept, kept.size());
+	/* dst shares the source's planes */
+	return poSource;
 }
 
 static const VSFrame* VS_CC CCLSGetFrame(int n, int activationReason, void* instanceData, void** frameData, VSFrameContext* frameCtx, VSCore* core, const VSAPI* vsapi) {
@@ -161,7 +256,7 @@ static const VSFrame* VS_CC CCLSGetFrame(int n, int activationReason, void* inst
 		int bits = d->vi->format.bitsPerSample;
 
 		try {
-			d->process_c_func(src, dst, bits, d, vsapi);
+			process_planes(src, dst, bits, d, getFrameParams(src, d, vsapi), vsapi);
 		}
 		catch (const std::exception& e) {
 			vsapi->setFilterError((std::string("TMaskCleanerMod error: ") + e.what()).c_str(), frameCtx);
@@ -201,12 +296,68 @@ void VS_CC CCLSCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core,
 		if (err)
 			connectivity = 8;
 
+		d->threads = static_cast<int>(vsapi->mapGetInt(in, "threads", 0, &err));
+		if (err)
+			d->threads = 1;
+
+		auto opt = static_cast<int>(vsapi->mapGetInt(in, "opt", 0, &err));
+		if (err)
+			opt = -1;
+		if (opt < -1 || opt > cpuAVX512)
+			throw std::string("opt must be -1 (auto), 0 (scalar), 1 (sse4.1), 2 (avx2) or 3 (avx512).");
+		d->kernels = select_kernels(opt);
+		if (!d->kernels)
+			throw std::string("opt=" + std::to_string(opt) + " is not supported by this CPU.");
+
+		d->intensity_stats = 0;
+		const int num_stats = vsapi->mapNumElements(in, "stats");
+		for (int i = 0; i < num_stats; ++i) {
+			const std::string name = vsapi->mapGetData(in, "stats", i, nullptr);
+			if (name == "sum")
+				d->intensity_stats |= isSum;
+			else if (name == "mean")
+				d->intensity_stats |= isMean;
+			else if (name == "min")
+				d->intensity_stats |= isMin;
+			else if (name == "max")
+				d->intensity_stats |= isMax;
+			else if (name == "weighted_centroid")
+				d->intensity_stats |= isCentroid;
+			else
+				throw std::string("unknown stats entry \"" + name + "\", expected sum, mean, min, max or weighted_centroid.");
+		}
+
+		d->packed_stats = !!vsapi->mapGetInt(in, "packed", 0, &err);
+		if (err)
+			d->packed_stats = false;
+
+		d->min_area = vsapi->mapGetInt(in, "min_area", 0, &err);
+		if (err)
+			d->min_area = 0;
+
+		d->max_labels = static_cast<int>(vsapi->mapGetInt(in, "max_labels", 0, &err));
+		if (err)
+			d->max_labels = 0;
+
+		d->roi = getRoi(in, d->vi, vsapi);
+		d->planes = getPlanes(in, d->vi, d->roi, vsapi);
+		getPropNames(in, d.get(), vsapi);
+
 		if (thresh <= 0 && d->vi->format.bytesPerSample < 4)
 			throw std::string("thresh must be greater than zero for 8-16bit clip.");
 
+		if (d->min_area < 0)
+			throw std::string("min_area must not be negative.");
+
+		if (d->max_labels < 0)
+			throw std::string("max_labels must not be negative, 0 keeps every component.");
+
 		if (connectivity != 4 && connectivity != 8)
 			throw std::string("connectivity must be either 4 or 8.");
 
+		if (d->threads < 1)
+			throw std::string("threads must be at least 1.");
+
 		if (connectivity == 4) {
 			d->directions = directions4;
 			d->dir_count = 4;
@@ -231,6 +382,7 @@ void VS_CC CCLSCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core,
 		return;
 	}
 
+	createPool(d.get());
 	VSFilterDependency deps[] = { {d->node, rpStrictSpatial} };
 	vsapi->createVideoFilter(out, "GetCCLStats", d->vi, CCLSGetFrame, FilterFree, fmParallel, deps, 1, d.get(), core);
 	d.release();
@@ -0,0 +1,406 @@
+#include "shared.h"
+
+template<typename pixel_t, typename label_t>
+PlaneOutput process_label(const VSFrame* src, VSFrame* dst, VSMap* props, int plane, int bits, const TMCData* d, const FrameParams& fp, const VSAPI* vsapi) {
+	const pixel_t* srcptr = reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(src, plane));
+	label_t* VS_RESTRICT dstptr = reinterpret_cast<label_t*>(vsapi->getWritePtr(dst, 0));
+	const int srcStride = vsapi->getStride(src, plane) / sizeof(pixel_t);
+	const int dstStride = vsapi->getStride(dst, 0) / sizeof(label_t);
+	int height = vsapi->getFrameHeight(src, plane);
+	int width = vsapi->getFrameWidth(src, plane);
+
+	thread_local CCLContext ctx;
+	ctx.kernels = d->kernels;
+	ctx.pool = d->pool.get();
+	const CCLScratch& scratch = ctx.scratch;
+
+	const pixel_t thresh = fp.get_thresh<pixel_t>();
+	const size_t num_components = ccl_label<pixel_t>(ctx, srcptr, srcStride, width, height, thresh, d->dir_count == 8, d->threads);
+
+	if (num_components > std::numeric_limits<label_t>::max())
+		throw std::runtime_error(std::to_string(num_components) + " components do not fit in a " + std::to_string(sizeof(label_t) * 8) + "-bit label plane, use bits=32.");
+
+	/* label 0 is the background, components are numbered from 1 */
+	parallel_for(d->pool.get(), static_cast<int>(scratch.strip_y.size()) - 1, [&](int strip) {
+		const int y0 = scratch.strip_y[strip], y1 = scratch.strip_y[strip + 1];
+		memset(dstptr + dstStride * y0, 0, (dstStride * sizeof(label_t)) * (y1 - y0));
+
+		for (uint32_t i = scratch.row_start[y0]; i < scratch.row_start[y1]; ++i) {
+			const Run& run = scratch.runs[i];
+			label_t* dd = dstptr + dstStride * run.y;
+			std::fill(dd + run.x0, dd + run.x1 + 1, static_cast<label_t>(scratch.parent[i] + 1));
+		}
+	});
+
+	ccl_background(ctx, width, height);
+	setCCLStatsProps(ctx.stats(), num_components, ctx.background, StatsOutput{}, props, vsapi);
+	ctx.trim();
+	return poWritten;
+}
+
+static const VSFrame* VS_CC LabelGetFrame(int n, int activationReason, void* instanceData, void** frameData, VSFrameContext* frameCtx, VSCore* core, const VSAPI* vsapi) {
+	TMCData* d = static_cast<TMCData*>(instanceData);
+
+	if (activationReason == arInitial) {
+		vsapi->requestFrameFilter(n, d->node, frameCtx);
+	}
+	else if (activationReason == arAllFramesReady) {
+		const VSFrame* src = vsapi->getFrameFilter(n, d->node, frameCtx);
+		int height = vsapi->getFrameHeight(src, 0);
+		int width = vsapi->getFrameWidth(src, 0);
+		VSFrame* dst = vsapi->newVideoFrame(&d->out_vi.format, width, height, src, core);
+		int bits = d->vi->format.bitsPerSample;
+
+		try {
+			d->process_c_func(src, dst, vsapi->getFramePropertiesRW(dst), 0, bits, d, d->frame_params(), vsapi);
+		}
+		catch (const std::exception& e) {
+			vsapi->setFilterError((std::string("Label error: ") + e.what()).c_str(), frameCtx);
+			vsapi->freeFrame(dst);
+			dst = nullptr;
+		}
+
+		vsapi->freeFrame(src);
+		return dst;
+	}
+	return nullptr;
+}
+
+void VS_CC LabelCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core, const VSAPI* vsapi) {
+	auto d{ std::make_unique<TMCData>() };
+	int err{ 0 };
+
+	d->node = vsapi->mapGetNode(in, "clip", 0, nullptr);
+	d->vi = vsapi->getVideoInfo(d->node);
+	try {
+		if (!vsh::isConstantVideoFormat(d->vi) || (d->vi->format.sampleType == stInteger && d->vi->format.bitsPerSample > 16) || (d->vi->format.sampleType == stFloat && d->vi->format.bitsPerSample != 32))
+			throw std::string("only constant format 8-16 bits integer, and f32 input supported.");
+
+		auto thresh = static_cast<float>(vsapi->mapGetFloat(in, "thresh", 0, &err));
+		if (err)
+			thresh = (d->vi->format.sampleType == stInteger) ? 235 << (d->vi->format.bitsPerSample - 8) : 1.0f;
+
+		if (d->vi->format.bytesPerSample == 1) {
+			d->set_thresh<uint8_t>(static_cast<uint8_t>(std::clamp(thresh, 0.0f, 255.0f)));
+		}
+		else if (d->vi->format.bytesPerSample == 2) {
+			d->set_thresh<uint16_t>(static_cast<uint16_t>(std::clamp(thresh, 0.0f, 65535.0f)));
+		}
+		else {
+			d->set_thresh<float>(thresh);
+		}
+
+		auto connectivity = static_cast<unsigned int>(vsapi->mapGetInt(in, "connectivity", 0, &err));
+		if (err)
+			connectivity = 8;
+
+		d->threads = static_cast<int>(vsapi->mapGetInt(in, "threads", 0, &err));
+		if (err)
+			d->threads = 1;
+
+		auto opt = static_cast<int>(vsapi->mapGetInt(in, "opt", 0, &err));
+		if (err)
+			opt = -1;
+		if (opt < -1 || opt > cpuAVX512)
+			throw std::string("opt must be -1 (auto), 0 (scalar), 1 (sse4.1), 2 (avx2) or 3 (avx512).");
+		d->kernels = select_kernels(opt);
+		if (!d->kernels)
+			throw std::string("opt=" + std::to_string(opt) + " is not supported by this CPU.");
+
+		auto label_bits = static_cast<int>(vsapi->mapGetInt(in, "bits", 0, &err));
+		if (err)
+			label_bits = 16;
+
+		if (thresh <= 0 && d->vi->format.bytesPerSample < 4)
+			throw std::string("thresh must be greater than zero for 8-16bit clip.");
+
+		if (connectivity != 4 && connectivity != 8)
+			throw std::string("connectivity must be either 4 or 8.");
+
+		if (d->threads < 1)
+			throw std::string("threads must be at least 1.");
+
+		if (label_bits != 16 && label_bits != 32)
+			throw std::string("bits must be either 16 or 32.");
+
+		if (connectivity == 4) {
+			d->directions = directions4;
+			d->dir_count = 4;
+		}
+		else {
+			d->directions = directions8;
+			d->dir_count = 8;
+		}
+
+		d->out_vi = *d->vi;
+		if (!vsapi->queryVideoFormat(&d->out_vi.format, cfGray, stInteger, label_bits, 0, 0, core))
+			throw std::string("failed to create the label plane format.");
+
+		// label_bits, data_bytes - 1
+		int selector = (d->vi->format.bytesPerSample - 1) | ((label_bits == 32) << 2);
+
+		switch (selector) {
+		case 0b000: d->process_c_func = &process_label<uint8_t, uint16_t>; break;
+		case 0b001: d->process_c_func = &process_label<uint16_t, uint16_t>; break;
+		case 0b011: d->process_c_func = &process_label<float, uint16_t>; break;
+		case 0b100: d->process_c_func = &process_label<uint8_t, uint32_t>; break;
+		case 0b101: d->process_c_func = &process_label<uint16_t, uint32_t>; break;
+		case 0b111: d->process_c_func = &process_label<float, uint32_t>; break;
+		default: throw std::string("Unsupported combination of parameters");
+		}
+	}
+	catch (const std::string& error) {
+		vsapi->mapSetError(out, ("Label: " + error).c_str());
+		vsapi->freeNode(d->node);
+		return;
+	}
+
+	createPool(d.get());
+	VSFilterDependency deps[] = { {d->node, rpStrictSpatial} };
+	vsapi->createVideoFilter(out, "Label", &d->out_vi, LabelGetFrame, FilterFree, fmParallel, deps, 1, d.get(), core);
+	d.release();
+}
+
+struct FilterLabelsData {
+	VSNode* node;
+	VSNode* label_node;
+	const VSVideoInfo* vi;
+	unsigned int length;
+	unsigned int fade;
+	bool binarize;
+	bool reverse;
+	int mode;
+	void (*apply)(const VSFrame*, const VSFrame*, VSFrame*, const double*, size_t, int, const VSAPI*);
+};
+
+// Writes every labelled pixel through the per-label fade factor table, using
+// the same arithmetic as process_c so the result matches TMaskCleanerMod. The
+// table covers every value the label plane can hold, labels past num_labels
+// are discarded, so the pass has no per-pixel range check.
+template<bool binarize, typename pixel_t, typename label_t>
+void apply_labels(const VSFrame* src, const VSFrame* labels, VSFrame* dst, const double* factors, size_t num_labels, int bits, const VSAPI* vsapi) {
+	const pixel_t* srcptr = reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(src, 0));
+	const label_t* labelptr = reinterpret_cast<const label_t*>(vsapi->getReadPtr(labels, 0));
+	pixel_t* VS_RESTRICT dstptr = reinterpret_cast<pixel_t*>(vsapi->getWritePtr(dst, 0));
+	const int srcStride = vsapi->getStride(src, 0) / sizeof(pixel_t);
+	const int labelStride = vsapi->getStride(labels, 0) / sizeof(label_t);
+	int height = vsapi->getFrameHeight(src, 0);
+	int width = vsapi->getFrameWidth(src, 0);
+
+	const auto peak = (sizeof(pixel_t) != 4) ? (1 << bits) - 1 : 1.0f;
+
+	/* 16-bit labels index a full table, 32-bit ones one up to the plane's largest label */
+	size_t table_size = size_t(1) << 16;
+	if constexpr (sizeof(label_t) == 4) {
+		label_t max_label = 0;
+		for (int y = 0; y < height; ++y) {
+			const label_t* l = labelptr + labelStride * y;
+			for (int x = 0; x < width; ++x) {
+				max_label = std::max(max_label, l[x]);
+			}
+		}
+		table_size = static_cast<size_t>(max_label) + 1;
+	}
+	table_size = std::max(table_size, num_labels);
+
+	thread_local std::vector<double> lookup;
+	thread_local std::vector<pixel_t> values;
+	if constexpr (binarize) {
+		values.assign(table_size, 0);
+		for (size_t label = 0; label < num_labels; ++label) {
+			values[label] = factors[label] < 0.0 ? 0 : static_cast<pixel_t>(peak * factors[label]);
+		}
+	}
+	else {
+		lookup.assign(factors, factors + num_labels);
+		lookup.resize(table_size, -1.0);
+	}
+
+	for (int y = 0; y < height; ++y) {
+		const pixel_t* s = srcptr + srcStride * y;
+		const label_t* l = labelptr + labelStride * y;
+		pixel_t* dd = dstptr + srcStride * y;
+
+		for (int x = 0; x < width; ++x) {
+			if constexpr (binarize) {
+				dd[x] = values[l[x]];
+			}
+			else {
+				const double fade_factor = lookup[l[x]];
+				dd[x] = fade_factor < 0.0 ? 0 : (fade_factor == 1.0 ? s[x] : static_cast<pixel_t>(s[x] * fade_factor));
+			}
+		}
+	}
+
+	trim_capacity(values, table_size);
+	trim_capacity(lookup, table_size);
+}
+
+// Evaluates the TMaskCleanerMod predicate for every label from the _CCLStat*
+// props of a label frame. Label 0 is the background and always stays black.
+static size_t buildLabelFactors(const VSMap* props, const FilterLabelsData* d, std::vector<double>& factors, const VSAPI* vsapi) {
+	int err{ 0 };
+	const int64_t count = vsapi->mapGetInt(props, "_CCLStatNumLabels", 0, &err);
+	if (err)
+		throw std::runtime_error("label clip has no _CCLStatNumLabels, use tmcm.Label to create it.");
+	/* the background is always label 0 */
+	if (count < 1 || count > std::numeric_limits<int>::max())
+		throw std::runtime_error("label clip has incomplete _CCLStat* props.");
+	const size_t num_labels = static_cast<size_t>(count);
+
+	const int64_t* areas = vsapi->mapGetIntArray(props, "_CCLStatAreas", &err);
+	const int64_t* lefts = vsapi->mapGetIntArray(props, "_CCLStatLefts", &err);
+	const int64_t* tops = vsapi->mapGetIntArray(props, "_CCLStatTops", &err);
+	const int64_t* widths = vsapi->mapGetIntArray(props, "_CCLStatWidths", &err);
+	const int64_t* heights = vsapi->mapGetIntArray(props, "_CCLStatHeights", &err);
+	const double* centroids_x = vsapi->mapGetFloatArray(props, "_CCLStatCentroids_x", &err);
+	const double* centroids_y = vsapi->mapGetFloatArray(props, "_CCLStatCentroids_y", &err);
+	if (err)
+		throw std::runtime_error("label clip has incomplete _CCLStat* props.");
+	for (const char* key : { "_CCLStatAreas", "_CCLStatLefts", "_CCLStatTops", "_CCLStatWidths", "_CCLStatHeights", "_CCLStatCentroids_x", "_CCLStatCentroids_y" }) {
+		if (vsapi->mapNumElements(props, key) != static_cast<int>(num_labels))
+			throw std::runtime_error("label clip has incomplete _CCLStat* props.");
+	}
+
+	factors.resize(num_labels);
+	factors[0] = -1.0;
+	const double fade_inv = d->fade > 0 ? 1.0f / d->fade : 0.0f;
+	for (size_t label = 1; label < num_labels; ++label) {
+		/* centroid sums are recovered exactly, area * centroid is within 0.5 of the integer sum */
+		ComponentStats c;
+		c.area = areas[label];
+		c.sum_x = std::llround(centroids_x[label] * areas[label]);
+		c.sum_y = std::llround(centroids_y[label] * areas[label]);
+		c.min_x = static_cast<int>(lefts[label]);
+		c.min_y = static_cast<int>(tops[label]);
+		c.max_x = static_cast<int>(lefts[label] + widths[label] - 1);
+		c.max_y = static_cast<int>(tops[label] + heights[label] - 1);
+
+		const size_t value = component_value(d->mode, c);
+		factors[label] = d->reverse ? component_factor<true>(value, d->length, d->fade, fade_inv) : component_factor<false>(value, d->length, d->fade, fade_inv);
+	}
+	return num_labels;
+}
+
+template<bool binarize, typename pixel_t>
+static void selectApplyLabels(FilterLabelsData* d, int label_bytes) {
+	if (label_bytes == 2)
+		d->apply = &apply_labels<binarize, pixel_t, uint16_t>;
+	else
+		d->apply = &apply_labels<binarize, pixel_t, uint32_t>;
+}
+
+static const VSFrame* VS_CC FilterLabelsGetFrame(int n, int activationReason, void* instanceData, void** frameData, VSFrameContext* frameCtx, VSCore* core, const VSAPI* vsapi) {
+	FilterLabelsData* d = static_cast<FilterLabelsData*>(instanceData);
+
+	if (activationReason == arInitial) {
+		vsapi->requestFrameFilter(n, d->node, frameCtx);
+		vsapi->requestFrameFilter(n, d->label_node, frameCtx);
+	}
+	else if (activationReason == arAllFramesReady) {
+		const VSFrame* src = vsapi->getFrameFilter(n, d->node, frameCtx);
+		const VSFrame* labels = vsapi->getFrameFilter(n, d->label_node, frameCtx);
+		const VSVideoFormat* fi = vsapi->getVideoFrameFormat(src);
+		int height = vsapi->getFrameHeight(src, 0);
+		int width = vsapi->getFrameWidth(src, 0);
+		const VSFrame* fr[] = { nullptr, src, src };
+		const int pl[] = { 0, 1, 2 };
+		VSFrame* dst = vsapi->newVideoFrame2(fi, width, height, fr, pl, src, core);
+		int bits = d->vi->format.bitsPerSample;
+
+		try {
+			thread_local std::vector<double> factors;
+			const size_t num_labels = buildLabelFactors(vsapi->getFramePropertiesRO(labels), d, factors, vsapi);
+			d->apply(src, labels, dst, factors.data(), num_labels, bits, vsapi);
+			trim_capacity(factors, num_labels);
+		}
+		catch (const std::exception& e) {
+			vsapi->setFilterError((std::string("FilterLabels error: ") + e.what()).c_str(), frameCtx);
+			vsapi->freeFrame(dst);
+			dst = nullptr;
+		}
+
+		vsapi->freeFrame(src);
+		vsapi->freeFrame(labels);
+		return dst;
+	}
+	return nullptr;
+}
+
+static void VS_CC FilterLabelsFree(void* instanceData, VSCore* core, const VSAPI* vsapi) {
+	auto d{ static_cast<FilterLabelsData*>(instanceData) };
+	vsapi->freeNode(d->node);
+	vsapi->freeNode(d->label_node);
+	delete d;
+}
+
+void VS_CC FilterLabelsCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core, const VSAPI* vsapi) {
+	auto d{ std::make_unique<FilterLabelsData>() };
+	int err{ 0 };
+
+	d->label_node = vsapi->mapGetNode(in, "labels", 0, nullptr);
+	d->node = vsapi->mapGetNode(in, "clip", 0, nullptr);
+	d->vi = vsapi->getVideoInfo(d->node);
+	const VSVideoInfo* label_vi = vsapi->getVideoInfo(d->label_node);
+
+	try {
+		if (!vsh::isConstantVideoFormat(d->vi) || (d->vi->format.sampleType == stInteger && d->vi->format.bitsPerSample > 16) || (d->vi->format.sampleType == stFloat && d->vi->format.bitsPerSample != 32))
+			throw std::string("only constant format 8-16 bits integer, and f32 input supported.");
+
+		if (!vsh::isConstantVideoFormat(label_vi) || label_vi->format.sampleType != stInteger || (label_vi->format.bitsPerSample != 16 && label_vi->format.bitsPerSample != 32))
+			throw std::string("labels must be a 16 or 32 bit integer clip created by tmcm.Label.");
+
+		if (label_vi->width != d->vi->width || label_vi->height != d->vi->height)
+			throw std::string("labels must have the same dimensions as clip.");
+
+		d->length = static_cast<unsigned int>(vsapi->mapGetInt(in, "length", 0, &err));
+		if (err)
+			d->length = 5;
+
+		d->fade = static_cast<unsigned int>(vsapi->mapGetInt(in, "fade", 0, &err));
+		if (err)
+			d->fade = 0;
+
+		d->binarize = static_cast<bool>(vsapi->mapGetInt(in, "binarize", 0, &err));
+		if (err)
+			d->binarize = false;
+
+		d->reverse = static_cast<bool>(vsapi->mapGetInt(in, "reverse", 0, &err));
+		if (err)
+			d->reverse = false;
+
+		d->mode = static_cast<int>(vsapi->mapGetInt(in, "mode", 0, &err));
+		if (err)
+			d->mode = 0;
+
+		if (d->length <= 0)
+			throw std::string("length must be greater than zero.");
+
+		if (d->mode < 0 || d->mode > 8)
+			throw std::string("mode must be in the range [0, 8].");
+
+		// binarize, data_bytes - 1
+		int selector = (d->vi->format.bytesPerSample - 1) | (d->binarize << 2);
+		const int label_bytes = label_vi->format.bytesPerSample;
+
+		switch (selector) {
+		case 0b000: selectApplyLabels<false, uint8_t>(d.get(), label_bytes); break;
+		case 0b001: selectApplyLabels<false, uint16_t>(d.get(), label_bytes); break;
+		case 0b011: selectApplyLabels<false, float>(d.get(), label_bytes); break;
+		case 0b100: selectApplyLabels<true, uint8_t>(d.get(), label_bytes); break;
+		case 0b101: selectApplyLabels<true, uint16_t>(d.get(), label_bytes); break;
+		case 0b111: selectApplyLabels<true, float>(d.get(), label_bytes); break;
+		default: throw std::string("Unsupported combination of parameters");
+		}
+	}
+	catch (const std::string& error) {
+		vsapi->mapSetError(out, ("FilterLabels: " + error).c_str());
+		vsapi->freeNode(d->node);
+		vsapi->freeNode(d->label_node);
+		return;
+	}
+
+	VSFilterDependency deps[] = { {d->node, rpStrictSpatial}, {d->label_node, rpStrictSpatial} };
+	vsapi->createVideoFilter(out, "FilterLabels", d->vi, FilterLabelsGetFrame, FilterLabelsFree, fmParallel, deps, 2, d.get(), core);
+	d.release();
+}
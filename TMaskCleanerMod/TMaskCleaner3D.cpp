@@ -0,0 +1,354 @@
+#include <map>
+#include <mutex>
+#include <thread>
+#include "shared.h"
+
+// Thresholded runs of one source frame, shared by every output frame whose
+// window holds it.
+struct FrameRuns {
+	std::mutex lock;
+	bool ready = false;
+	std::vector<Run> runs;
+	// runs of row y are [row_start[y], row_start[y + 1])
+	std::vector<uint32_t> row_start;
+};
+
+// Measures of one spatio-temporal component, t counted from the window start.
+struct VolumeStats {
+	int64_t voxels;
+	int64_t area; // pixels in the output frame
+	int min_t;
+	int max_t;
+};
+
+enum VolumeMode : int {
+	vmVoxels,
+	vmArea,
+	vmDuration
+};
+
+struct TMC3DData {
+	VSNode* node;
+	const VSVideoInfo* vi;
+	TMCData params;
+	int radius;
+	int mode;
+	// overlap widening towards the row above in the same frame, and towards the
+	// same and the adjacent rows of the previous frame; -1 links nothing
+	int reach_plane;
+	int reach_same;
+	int reach_adjacent;
+	void (*process)(const VSFrame* const*, int, int, VSFrame*, int, const TMC3DData*, FrameRuns* const*, const VSAPI*);
+
+	std::mutex cache_lock;
+	std::map<int, std::shared_ptr<FrameRuns>> cache;
+	size_t max_cached;
+};
+
+static size_t volume_value(int mode, const VolumeStats& c) {
+	switch (mode) {
+	case vmArea: return c.area;
+	case vmDuration: return c.max_t - c.min_t + 1;
+	default: return c.voxels;
+	}
+}
+
+template<typename pixel_t>
+static void extract_frame_runs(const VSFrame* frame, const TMCData* p, FrameRuns& out, const VSAPI* vsapi) {
+	thread_local Bitmap bitmap;
+
+	const pixel_t* srcptr = reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(frame, 0));
+	const int srcStride = vsapi->getStride(frame, 0) / sizeof(pixel_t);
+	const int height = vsapi->getFrameHeight(frame, 0);
+	const int width = vsapi->getFrameWidth(frame, 0);
+
+	threshold_plane<pixel_t>(*p->kernels, srcptr, srcStride, width, height, p->get_thresh<pixel_t>(), bitmap);
+	out.runs.clear();
+	out.row_start.resize(static_cast<size_t>(height) + 1);
+	out.row_start[0] = 0;
+	extract_runs(*p->kernels, bitmap, 0, height, out.runs, out.row_start.data() + 1);
+	trim_capacity(out.runs, out.runs.size());
+}
+
+// Labels the runs of the count frames in frames, window[centre] being the
+// output frame, and writes the output frame's runs whose component passes.
+// Frames are unioned row by row in time order, so roots stay the smallest run
+// index as in union_rows().
+template<bool binarize, bool reverse, typename pixel_t>
+static void process_3d(const VSFrame* const* window, int count, int centre, VSFrame* dst, int bits, const TMC3DData* d, FrameRuns* const* frames, const VSAPI* vsapi) {
+	const TMCData* p = &d->params;
+	const int height = vsapi->getFrameHeight(window[centre], 0);
+	const int width = vsapi->getFrameWidth(window[centre], 0);
+
+	thread_local std::vector<Run> runs;
+	thread_local std::vector<uint32_t> row_start;
+	thread_local std::vector<uint32_t> parent;
+	thread_local std::vector<VolumeStats> stats;
+	thread_local std::vector<double> fade_factors;
+
+	for (int t = 0; t < count; ++t) {
+		std::lock_guard<std::mutex> guard(frames[t]->lock);
+		if (!frames[t]->ready) {
+			extract_frame_runs<pixel_t>(window[t], p, *frames[t], vsapi);
+			frames[t]->ready = true;
+		}
+	}
+
+	/* row y of frame t is [row_start[t * height + y], row_start[t * height + y + 1]) */
+	runs.clear();
+	row_start.resize(static_cast<size_t>(count) * height + 1);
+	for (int t = 0; t < count; ++t) {
+		const uint32_t offset = static_cast<uint32_t>(runs.size());
+		for (int y = 0; y < height; ++y) {
+			row_start[static_cast<size_t>(t) * height + y] = offset + frames[t]->row_start[y];
+		}
+		runs.insert(runs.end(), frames[t]->runs.begin(), frames[t]->runs.end());
+	}
+	row_start.back() = static_cast<uint32_t>(runs.size());
+	parent.resize(runs.size());
+	std::iota(parent.begin(), parent.end(), 0u);
+
+	auto row = [&](int t, int y) { return row_start.data() + static_cast<size_t>(t) * height + y; };
+	for (int t = 0; t < count; ++t) {
+		for (int y = 0; y < height; ++y) {
+			const uint32_t c = row(t, y)[0], c_end = row(t, y)[1];
+			if (c == c_end) continue;
+			if (y > 0)
+				union_overlaps(runs.data(), parent.data(), row(t, y - 1)[0], row(t, y - 1)[1], c, c_end, d->reach_plane);
+			if (t == 0) continue;
+			union_overlaps(runs.data(), parent.data(), row(t - 1, y)[0], row(t - 1, y)[1], c, c_end, d->reach_same);
+			if (d->reach_adjacent < 0) continue;
+			if (y > 0)
+				union_overlaps(runs.data(), parent.data(), row(t - 1, y - 1)[0], row(t - 1, y - 1)[1], c, c_end, d->reach_adjacent);
+			if (y + 1 < height)
+				union_overlaps(runs.data(), parent.data(), row(t - 1, y + 1)[0], row(t - 1, y + 1)[1], c, c_end, d->reach_adjacent);
+		}
+	}
+
+	uint32_t num_components = 0;
+	for (size_t i = 0; i < parent.size(); ++i) {
+		parent[i] = (parent[i] == i) ? num_components++ : parent[parent[i]];
+	}
+	stats.assign(num_components, VolumeStats{ 0, 0, INT32_MAX, -1 });
+	for (int t = 0; t < count; ++t) {
+		for (uint32_t i = row(t, 0)[0]; i < row(t, height)[0]; ++i) {
+			VolumeStats& c = stats[parent[i]];
+			const int64_t len = runs[i].x1 - runs[i].x0 + 1;
+			c.voxels += len;
+			if (t == centre)
+				c.area += len;
+			c.min_t = std::min(c.min_t, t);
+			c.max_t = t;
+		}
+	}
+
+	const double fade_inv = p->fade > 0 ? 1.0f / p->fade : 0.0f;
+	fade_factors.resize(num_components);
+	for (size_t label = 0; label < num_components; ++label) {
+		fade_factors[label] = component_factor<reverse>(volume_value(d->mode, stats[label]), p->length, p->fade, fade_inv);
+	}
+
+	const pixel_t* srcptr = reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(window[centre], 0));
+	pixel_t* VS_RESTRICT dstptr = reinterpret_cast<pixel_t*>(vsapi->getWritePtr(dst, 0));
+	const int stride = vsapi->getStride(dst, 0) / sizeof(pixel_t);
+	const auto peak = (sizeof(pixel_t) != 4) ? (1 << bits) - 1 : 1.0f;
+	for (int y = 0; y < height; ++y) {
+		memset(dstptr + stride * y, 0, width * sizeof(pixel_t));
+	}
+	const uint32_t first = row(centre, 0)[0];
+	p->kernels->pixel<pixel_t>().write_runs[binarize](srcptr, dstptr, stride, peak, runs.data() + first, parent.data() + first, row(centre, height)[0] - first, fade_factors.data());
+
+	trim_capacity(runs, runs.size());
+	trim_capacity(parent, parent.size());
+	trim_capacity(stats, stats.size());
+	trim_capacity(fade_factors, fade_factors.size());
+}
+
+// Cache entry of source frame n, created when missing. When the cache is full
+// the entries farthest from n go first, so neighbouring outputs keep sharing.
+static std::shared_ptr<FrameRuns> acquireFrameRuns(TMC3DData* d, int n, int output) {
+	std::lock_guard<std::mutex> guard(d->cache_lock);
+	auto& entry = d->cache[n];
+	if (!entry)
+		entry = std::make_shared<FrameRuns>();
+	const auto frame_runs = entry;
+	while (d->cache.size() > d->max_cached) {
+		const auto first = d->cache.begin();
+		const auto last = std::prev(d->cache.end());
+		d->cache.erase(output - first->first > last->first - output ? first : last);
+	}
+	return frame_runs;
+}
+
+static const VSFrame* VS_CC TMC3DGetFrame(int n, int activationReason, void* instanceData, void** frameData, VSFrameContext* frameCtx, VSCore* core, const VSAPI* vsapi) {
+	TMC3DData* d = static_cast<TMC3DData*>(instanceData);
+	const int first = std::max(n - d->radius, 0);
+	const int last = std::min(n + d->radius, d->vi->numFrames - 1);
+
+	if (activationReason == arInitial) {
+		for (int i = first; i <= last; ++i) {
+			vsapi->requestFrameFilter(i, d->node, frameCtx);
+		}
+	}
+	else if (activationReason == arAllFramesReady) {
+		const int count = last - first + 1;
+		std::vector<const VSFrame*> window(count);
+		std::vector<std::shared_ptr<FrameRuns>> entries(count);
+		std::vector<FrameRuns*> frames(count);
+		for (int t = 0; t < count; ++t) {
+			window[t] = vsapi->getFrameFilter(first + t, d->node, frameCtx);
+		}
+
+		const VSFrame* src = window[n - first];
+		const VSVideoFormat* fi = vsapi->getVideoFrameFormat(src);
+		int height = vsapi->getFrameHeight(src, 0);
+		int width = vsapi->getFrameWidth(src, 0);
+		const VSFrame* fr[] = { nullptr, src, src };
+		const int pl[] = { 0, 1, 2 };
+		VSFrame* dst = vsapi->newVideoFrame2(fi, width, height, fr, pl, src, core);
+		int bits = d->vi->format.bitsPerSample;
+
+		try {
+			for (int t = 0; t < count; ++t) {
+				entries[t] = acquireFrameRuns(d, first + t, n);
+				frames[t] = entries[t].get();
+			}
+			d->process(window.data(), count, n - first, dst, bits, d, frames.data(), vsapi);
+		}
+		catch (const std::exception& e) {
+			vsapi->setFilterError((std::string("TMaskCleaner3D error: ") + e.what()).c_str(), frameCtx);
+			vsapi->freeFrame(dst);
+			dst = nullptr;
+		}
+
+		for (const VSFrame* frame : window) {
+			vsapi->freeFrame(frame);
+		}
+		return dst;
+	}
+	return nullptr;
+}
+
+static void VS_CC TMC3DFree(void* instanceData, VSCore* core, const VSAPI* vsapi) {
+	auto d{ static_cast<TMC3DData*>(instanceData) };
+	vsapi->freeNode(d->node);
+	delete d;
+}
+
+void VS_CC TMC3DCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core, const VSAPI* vsapi) {
+	auto d{ std::make_unique<TMC3DData>() };
+	TMCData* p = &d->params;
+	int err{ 0 };
+
+	d->node = vsapi->mapGetNode(in, "clip", 0, nullptr);
+	d->vi = vsapi->getVideoInfo(d->node);
+
+	try {
+		if (!vsh::isConstantVideoFormat(d->vi) || (d->vi->format.sampleType == stInteger && d->vi->format.bitsPerSample > 16) || (d->vi->format.sampleType == stFloat && d->vi->format.bitsPerSample != 32))
+			throw std::string("only constant format 8-16 bits integer, and f32 input supported.");
+
+		d->radius = static_cast<int>(vsapi->mapGetInt(in, "radius", 0, &err));
+		if (err)
+			d->radius = 1;
+
+		p->length = static_cast<unsigned int>(vsapi->mapGetInt(in, "length", 0, &err));
+		if (err)
+			p->length = 5;
+
+		auto thresh = static_cast<float>(vsapi->mapGetFloat(in, "thresh", 0, &err));
+		if (err)
+			thresh = (d->vi->format.sampleType == stInteger) ? 235 << (d->vi->format.bitsPerSample - 8) : 1.0f;
+
+		if (d->vi->format.bytesPerSample == 1) {
+			p->set_thresh<uint8_t>(static_cast<uint8_t>(std::clamp(thresh, 0.0f, 255.0f)));
+		}
+		else if (d->vi->format.bytesPerSample == 2) {
+			p->set_thresh<uint16_t>(static_cast<uint16_t>(std::clamp(thresh, 0.0f, 65535.0f)));
+		}
+		else {
+			p->set_thresh<float>(thresh);
+		}
+
+		p->fade = static_cast<unsigned int>(vsapi->mapGetInt(in, "fade", 0, &err));
+		if (err)
+			p->fade = 0;
+
+		auto binarize = static_cast<bool>(vsapi->mapGetInt(in, "binarize", 0, &err));
+		if (err)
+			binarize = false;
+
+		auto connectivity = static_cast<unsigned int>(vsapi->mapGetInt(in, "connectivity", 0, &err));
+		if (err)
+			connectivity = 26;
+
+		auto reverse = static_cast<bool>(vsapi->mapGetInt(in, "reverse", 0, &err));
+		if (err)
+			reverse = false;
+
+		d->mode = static_cast<int>(vsapi->mapGetInt(in, "mode", 0, &err));
+		if (err)
+			d->mode = vmVoxels;
+
+		auto opt = static_cast<int>(vsapi->mapGetInt(in, "opt", 0, &err));
+		if (err)
+			opt = -1;
+		if (opt < -1 || opt > cpuAVX512)
+			throw std::string("opt must be -1 (auto), 0 (scalar), 1 (sse4.1), 2 (avx2) or 3 (avx512).");
+		p->kernels = select_kernels(opt);
+		if (!p->kernels)
+			throw std::string("opt=" + std::to_string(opt) + " is not supported by this CPU.");
+
+		if (d->radius < 0)
+			throw std::string("radius cannot be negative.");
+
+		if (p->length <= 0)
+			throw std::string("length must be greater than zero.");
+
+		if (thresh <= 0 && d->vi->format.bytesPerSample < 4)
+			throw std::string("thresh must be greater than zero for 8-16bit clip.");
+
+		if (d->mode < vmVoxels || d->mode > vmDuration)
+			throw std::string("mode must be 0 (voxels), 1 (area) or 2 (duration).");
+
+		/* 6: faces, 18: faces and edges, 26: faces, edges and corners */
+		switch (connectivity) {
+		case 6: d->reach_plane = 0; d->reach_same = 0; d->reach_adjacent = -1; break;
+		case 18: d->reach_plane = 1; d->reach_same = 1; d->reach_adjacent = 0; break;
+		case 26: d->reach_plane = 1; d->reach_same = 1; d->reach_adjacent = 1; break;
+		default: throw std::string("connectivity must be 6, 18 or 26.");
+		}
+
+		// binarize, reverse, data_bytes - 1
+		int selector = (d->vi->format.bytesPerSample - 1) |
+			(reverse << 2) |
+			(binarize << 3);
+
+		switch (selector) {
+		case 0b0000: d->process = &process_3d<false, false, uint8_t>; break;
+		case 0b0001: d->process = &process_3d<false, false, uint16_t>; break;
+		case 0b0011: d->process = &process_3d<false, false, float>; break;
+		case 0b0100: d->process = &process_3d<false, true, uint8_t>; break;
+		case 0b0101: d->process = &process_3d<false, true, uint16_t>; break;
+		case 0b0111: d->process = &process_3d<false, true, float>; break;
+		case 0b1000: d->process = &process_3d<true, false, uint8_t>; break;
+		case 0b1001: d->process = &process_3d<true, false, uint16_t>; break;
+		case 0b1011: d->process = &process_3d<true, false, float>; break;
+		case 0b1100: d->process = &process_3d<true, true, uint8_t>; break;
+		case 0b1101: d->process = &process_3d<true, true, uint16_t>; break;
+		case 0b1111: d->process = &process_3d<true, true, float>; break;
+		default: throw std::string("Unsupported combination of parameters");
+		}
+	}
+	catch (const std::string& error) {
+		vsapi->mapSetError(out, ("TMaskCleaner3D: " + error).c_str());
+		vsapi->freeNode(d->node);
+		return;
+	}
+
+	/* one window per worker plus the frames its neighbours are about to share */
+	d->max_cached = 2 * static_cast<size_t>(d->radius) + 1 + 2 * std::thread::hardware_concurrency();
+
+	VSFilterDependency deps[] = { {d->node, rpGeneral} };
+	vsapi->createVideoFilter(out, "TMaskCleaner3D", d->vi, TMC3DGetFrame, TMC3DFree, fmParallel, deps, 1, d.get(), core);
+	d.release();
+}
@@ -1,153 +1,566 @@
 #include "shared.h"
 
-template<int filter_mode, bool binarize, bool reverse, typename pixel_t>
-void process_c(const VSFrame* src, VSFrame* dst, int bits, const TMCData* d, const VSAPI* vsapi) {
-	const pixel_t* srcptr = reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(src, 0));
-	pixel_t* VS_RESTRICT dstptr = reinterpret_cast<pixel_t*>(vsapi->getWritePtr(dst, 0));
-	const int srcStride = vsapi->getStride(src, 0) / sizeof(pixel_t);
-	int height = vsapi->getFrameHeight(src, 0);
-	int width = vsapi->getFrameWidth(src, 0);
-	memset(dstptr, 0, (srcStride * sizeof(pixel_t)) * height);
+// Value of filter_mode for a component flooded so far. Modes 1 and 2 keep
+// coordinate sums in max_x / max_y and are only known at the end.
+template<int filter_mode>
+static size_t running_value(size_t area, int min_x, int min_y, int max_x, int max_y) {
+	if constexpr (filter_mode == 3) return min_x;
+	else if constexpr (filter_mode == 4) return min_y;
+	else if constexpr (filter_mode == 5) return max_x;
+	else if constexpr (filter_mode == 6) return max_y;
+	else if constexpr (filter_mode == 7) return max_x - min_x + 1;
+	else if constexpr (filter_mode == 8) return max_y - min_y + 1;
+	else return area;
+}
 
-	thread_local std::vector<uint8_t> lookup;
-	const size_t lookup_size = (height * width + 7) >> 3;
-	if (lookup.size() != lookup_size) {
-		lookup.resize(lookup_size, 0);
+// Sets factor and returns true when a component whose running value is value
+// is sure to end with that fade factor. Area, width, height, max_x and max_y
+// only grow while flooding and min_x only shrinks, so a component is decided
+// once it is drawn at the full factor while moving towards being drawn, or
+// discarded while moving away from it. min_y is final at the seed, the first
+// pixel in raster order.
+template<int filter_mode, bool reverse>
+static bool early_factor(size_t value, unsigned int length, unsigned int fade, double fade_inv, double& factor) {
+	if constexpr (filter_mode == 1 || filter_mode == 2) {
+		return false;
 	}
 	else {
-		std::fill(lookup.begin(), lookup.end(), 0);
+		factor = component_factor<reverse>(value, length, fade, fade_inv);
+		if constexpr (filter_mode == 4)
+			return true;
+		else if constexpr ((filter_mode != 3) != reverse)
+			return factor == 1.0;
+		else
+			return factor < 0.0;
 	}
+}
 
+template<int filter_mode, bool binarize, bool reverse, typename pixel_t>
+PlaneOutput process_c_floodfill(const VSFrame* src, VSFrame* dst, VSMap* props, int plane, int bits, const TMCData* d, const FrameParams& fp, const VSAPI* vsapi) {
+	const pixel_t* srcptr = reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(src, plane));
+	pixel_t* VS_RESTRICT dstptr = reinterpret_cast<pixel_t*>(vsapi->getWritePtr(dst, plane));
+	const int srcStride = vsapi->getStride(src, plane) / sizeof(pixel_t);
+	int height = vsapi->getFrameHeight(src, plane);
+	int width = vsapi->getFrameWidth(src, plane);
+	memset(dstptr, 0, (srcStride * sizeof(pixel_t)) * height);
+
+	thread_local Bitmap bitmap;
 	thread_local std::vector<Coordinates> coordinates;
-	thread_local std::vector<Coordinates> white_pixels;
-	coordinates.reserve(4096);
-	white_pixels.reserve(4096);
+	/* per-pixel component id, 0 for background, and the fade factor of each id */
+	thread_local std::vector<uint32_t> labels;
+	thread_local std::vector<double> fade_factors;
 
 	const auto peak = (sizeof(pixel_t) != 4) ? (1 << bits) - 1 : 1.0f;
 	const auto& directions = d->directions;
 	const int dir_count = d->dir_count;
-	const pixel_t thresh = d->get_thresh<pixel_t>();
-	const auto length = d->length;
-	const auto fade = d->fade;
+	const pixel_t thresh = fp.get_thresh<pixel_t>();
+	const auto length = fp.length;
+	const auto fade = fp.fade;
 	const double fade_inv = fade > 0 ? 1.0f / fade : 0.0f;
 
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			if (visited(x, y, width, lookup)) continue;
-			if (is_black<pixel_t>(srcptr[srcStride * y + x], thresh)) continue;
-
-			coordinates.clear();
-			white_pixels.clear();
-
-			coordinates.emplace_back(x, y);
-			white_pixels.emplace_back(x, y);
-			visit(x, y, width, lookup);
-
-			int min_x = x, min_y = y, max_x = x, max_y = y;
-			while (!coordinates.empty()) {
-				/* pop last coordinates */
-				Coordinates current = coordinates.back();
-				coordinates.pop_back();
-
-				for (int dir = 0; dir < dir_count; dir++) {
-					const int i = current.first + directions[dir].first;
-					const int j = current.second + directions[dir].second;
-
-					if (i < 0 || i >= width || j < 0 || j >= height) continue;
-					if (visited(i, j, width, lookup)) continue;
-					if (is_black<pixel_t>(srcptr[srcStride * j + i], thresh)) continue;
+	auto write_pixel = [&](int x, int y, double fade_factor) {
+		if constexpr (binarize) {
+			dstptr[srcStride * y + x] = peak * fade_factor;
+		}
+		else {
+			dstptr[srcStride * y + x] = srcptr[srcStride * y + x] * fade_factor;
+		}
+	};
 
-					coordinates.emplace_back(i, j);
-					white_pixels.emplace_back(i, j);
-					visit(i, j, width, lookup);
+	/* foreground bits are cleared as they are visited */
+	threshold_plane<pixel_t>(*d->kernels, srcptr, srcStride, width, height, thresh, bitmap);
+	labels.assign(static_cast<size_t>(width) * height, 0);
+	fade_factors.assign(1, -1.0);
+	size_t max_stack = 0;
 
-					if constexpr (filter_mode == 1) { // centriod_x
-						max_x += i;
-					}
-					else if constexpr (filter_mode == 2) { // centriod_y
-						max_y += j;
-					}
-					else if constexpr (filter_mode == 3) { // min_x
-						min_x = std::min(min_x, i);
-					}
-					else if constexpr (filter_mode == 4) { // min_y
-						min_y = std::min(min_y, j);
-					}
-					else if constexpr (filter_mode == 5) { // max_x
-						max_x = std::max(max_x, i);
-					}
-					else if constexpr (filter_mode == 6) { // max_y
-						max_y = std::max(max_y, j);
+	for (int y = 0; y < height; ++y) {
+		const uint64_t* row = bitmap.row(y);
+		for (size_t wi = bitmap.spans[y].begin; wi < bitmap.spans[y].end; ++wi) {
+			while (row[wi]) {
+				const int x = static_cast<int>(wi << 6) + ctz64(row[wi]);
+				const uint32_t label = static_cast<uint32_t>(fade_factors.size());
+
+				size_t area = 1;
+				int min_x = x, min_y = y, max_x = x, max_y = y;
+
+				/* once the factor is decided, pixels are written directly instead of labelled */
+				double factor = -1.0;
+				bool decided = early_factor<filter_mode, reverse>(running_value<filter_mode>(area, min_x, min_y, max_x, max_y), length, fade, fade_inv, factor);
+				auto visit = [&](int i, int j) {
+					if (!decided) {
+						labels[static_cast<size_t>(width) * j + i] = label;
 					}
-					else if constexpr (filter_mode == 7) { // width
-						min_x = std::min(min_x, i);
-						max_x = std::max(max_x, i);
+					else if (factor >= 0.0) {
+						write_pixel(i, j, factor);
 					}
-					else if constexpr (filter_mode == 8) { // height
-						min_y = std::min(min_y, j);
-						max_y = std::max(max_y, j);
+				};
+
+				coordinates.clear();
+				coordinates.emplace_back(x, y);
+				visit(x, y);
+				bitmap.clear(x, y);
+
+				while (!coordinates.empty()) {
+					/* pop last coordinates */
+					Coordinates current = coordinates.back();
+					coordinates.pop_back();
+
+					for (int dir = 0; dir < dir_count; dir++) {
+						const int i = current.first + directions[dir].first;
+						const int j = current.second + directions[dir].second;
+
+						if (!bitmap.test(i, j)) continue;
+
+						coordinates.emplace_back(i, j);
+						bitmap.clear(i, j);
+						++area;
+
+						if constexpr (filter_mode == 1) { // centriod_x
+							max_x += i;
+						}
+						else if constexpr (filter_mode == 2) { // centriod_y
+							max_y += j;
+						}
+						else if constexpr (filter_mode == 3) { // min_x
+							min_x = std::min(min_x, i);
+						}
+						else if constexpr (filter_mode == 4) { // min_y
+							min_y = std::min(min_y, j);
+						}
+						else if constexpr (filter_mode == 5) { // max_x
+							max_x = std::max(max_x, i);
+						}
+						else if constexpr (filter_mode == 6) { // max_y
+							max_y = std::max(max_y, j);
+						}
+						else if constexpr (filter_mode == 7) { // width
+							min_x = std::min(min_x, i);
+							max_x = std::max(max_x, i);
+						}
+						else if constexpr (filter_mode == 8) { // height
+							min_y = std::min(min_y, j);
+							max_y = std::max(max_y, j);
+						}
+
+						if (!decided)
+							decided = early_factor<filter_mode, reverse>(running_value<filter_mode>(area, min_x, min_y, max_x, max_y), length, fade, fade_inv, factor);
+						visit(i, j);
 					}
+					max_stack = std::max(max_stack, coordinates.size());
 				}
-			}
 
-			size_t component_value;
-			if constexpr (filter_mode == 0) { // pixel count
-				component_value = white_pixels.size();
-			}
-			else if constexpr (filter_mode == 1) { // centriod_x
-				component_value = max_x / white_pixels.size();
-			}
-			else if constexpr (filter_mode == 2) { // centriod_y
-				component_value = max_y / white_pixels.size();
-			}
-			else if constexpr (filter_mode == 3) { // min_x
-				component_value = min_x;
-			}
-			else if constexpr (filter_mode == 4) { // min_y
-				component_value = min_y;
-			}
-			else if constexpr (filter_mode == 5) { // max_x
-				component_value = max_x;
-			}
-			else if constexpr (filter_mode == 6) { // max_y
-				component_value = max_y;
-			}
-			else if constexpr (filter_mode == 7) { // width
-				component_value = max_x - min_x + 1;
-			}
-			else if constexpr (filter_mode == 8) { // height
-				component_value = max_y - min_y + 1;
+				size_t component_value;
+				if constexpr (filter_mode == 0) { // pixel count
+					component_value = area;
+				}
+				else if constexpr (filter_mode == 1) { // centriod_x
+					component_value = max_x / area;
+				}
+				else if constexpr (filter_mode == 2) { // centriod_y
+					component_value = max_y / area;
+				}
+				else if constexpr (filter_mode == 3) { // min_x
+					component_value = min_x;
+				}
+				else if constexpr (filter_mode == 4) { // min_y
+					component_value = min_y;
+				}
+				else if constexpr (filter_mode == 5) { // max_x
+					component_value = max_x;
+				}
+				else if constexpr (filter_mode == 6) { // max_y
+					component_value = max_y;
+				}
+				else if constexpr (filter_mode == 7) { // width
+					component_value = max_x - min_x + 1;
+				}
+				else if constexpr (filter_mode == 8) { // height
+					component_value = max_y - min_y + 1;
+				}
+
+				/* a decided factor is final, the pixels labelled before it agree */
+				fade_factors.push_back(component_factor<reverse>(component_value, length, fade, fade_inv));
 			}
+		}
+	}
 
-			bool should_draw;
-			double fade_factor = 1.0;
-			if constexpr (!reverse) {
-				should_draw = (component_value >= length);
-				if (should_draw && fade > 0 && (component_value - length <= fade)) {
-					fade_factor = (component_value - length) * fade_inv;
-				}
+	for (int y = 0; y < height; ++y) {
+		const uint32_t* l = labels.data() + static_cast<size_t>(width) * y;
+		const pixel_t* s = srcptr + srcStride * y;
+		pixel_t* dd = dstptr + srcStride * y;
+		const int x_end = std::min(width, static_cast<int>(bitmap.spans[y].end << 6));
+
+		for (int x = static_cast<int>(bitmap.spans[y].begin << 6); x < x_end; ++x) {
+			const double fade_factor = fade_factors[l[x]];
+			if (fade_factor < 0.0) continue;
+
+			if constexpr (binarize) {
+				dd[x] = peak * fade_factor;
 			}
 			else {
-				should_draw = (component_value <= length);
-				if (should_draw && fade > 0 && (length - component_value <= fade)) {
-					fade_factor = (length - component_value) * fade_inv;
-				}
+				dd[x] = s[x] * fade_factor;
 			}
+		}
+	}
 
-			if (should_draw) {
-				for (const auto& pixel : white_pixels) {
-					const auto pos = srcStride * pixel.second + pixel.first;
+	trim_capacity(coordinates, max_stack);
+	trim_capacity(labels, labels.size());
+	trim_capacity(fade_factors, fade_factors.size());
+	return poWritten;
+}
 
-					if constexpr (binarize) {
-						dstptr[pos] = peak * fade_factor;
-					}
-					else {
-						dstptr[pos] = srcptr[pos] * fade_factor;
-					}
+// Fills the runs of every background component with a negative factor with
+// peak, one strip per worker. Runs only the pixels being filled.
+template<typename pixel_t>
+static void fill_components(pixel_t* VS_RESTRICT dstptr, int stride, int bits, const CCLScratch& holes, const double* fill_factors, WorkerPool* pool) {
+	const auto peak = (sizeof(pixel_t) != 4) ? (1 << bits) - 1 : 1.0f;
+
+	parallel_for(pool, static_cast<int>(holes.strip_y.size()) - 1, [&](int strip) {
+		const int y0 = holes.strip_y[strip], y1 = holes.strip_y[strip + 1];
+		for (uint32_t i = holes.row_start[y0]; i < holes.row_start[y1]; ++i) {
+			if (fill_factors[holes.parent[i]] >= 0.0) continue;
+
+			const Run& run = holes.runs[i];
+			pixel_t* dd = dstptr + stride * run.y;
+			std::fill(dd + run.x0, dd + run.x1 + 1, static_cast<pixel_t>(peak));
+		}
+	});
+}
+
+// Also discards the kept components without a pixel at or above high. Those
+// the length/mode predicate already discarded are not scanned.
+template<typename pixel_t>
+static void discard_unseeded(const pixel_t* srcptr, int stride, pixel_t high, const CCLScratch& scratch, std::vector<double>& fade_factors, std::vector<uint8_t>& seeded) {
+	seeded.resize(fade_factors.size());
+	for (size_t label = 0; label < fade_factors.size(); ++label) {
+		seeded[label] = fade_factors[label] < 0.0;
+	}
+	mark_seeded<pixel_t>(srcptr, stride, high, scratch, seeded.data());
+	for (size_t label = 0; label < fade_factors.size(); ++label) {
+		if (!seeded[label])
+			fade_factors[label] = -1.0;
+	}
+	trim_capacity(seeded, seeded.size());
+}
+
+template<int filter_mode, bool binarize, bool reverse, typename pixel_t, bool profile>
+PlaneOutput process_c(const VSFrame* src, VSFrame* dst, VSMap* props, int plane, int bits, const TMCData* d, const FrameParams& fp, const VSAPI* vsapi) {
+	const pixel_t* srcptr = reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(src, plane));
+	pixel_t* VS_RESTRICT dstptr = reinterpret_cast<pixel_t*>(vsapi->getWritePtr(dst, plane));
+	const int srcStride = vsapi->getStride(src, plane) / sizeof(pixel_t);
+	int height = vsapi->getFrameHeight(src, plane);
+	int width = vsapi->getFrameWidth(src, plane);
+
+	thread_local CCLContext ctx;
+	thread_local CCLScratch holes;
+	thread_local std::vector<uint8_t> seeded;
+	ctx.kernels = d->kernels;
+	ctx.pool = d->pool.get();
+	CCLScratch& scratch = ctx.scratch;
+	std::vector<double>& fade_factors = ctx.fade_factors;
+
+	const pixel_t thresh = fp.get_thresh<pixel_t>();
+	const auto length = fp.length;
+	const auto fade = fp.fade;
+
+	const bool roi = d->roi.width > 0;
+	if (roi) {
+		write_outside_roi<pixel_t>(srcptr, dstptr, srcStride, width, height, d->roi, d->roi_copy);
+		srcptr += srcStride * d->roi.top + d->roi.left;
+		dstptr += srcStride * d->roi.top + d->roi.left;
+		width = d->roi.width;
+		height = d->roi.height;
+	}
+
+	FrameProfile prof;
+	[[maybe_unused]] profile_clock::time_point start;
+	if constexpr (profile)
+		start = profile_clock::now();
+
+	const size_t num_components = ccl_label<pixel_t>(ctx, srcptr, srcStride, width, height, thresh, d->dir_count == 8, d->threads, profile ? &prof.threshold_ms : nullptr);
+	if (roi)
+		offset_stats(scratch.stats.data(), num_components, d->roi.left, d->roi.top);
+
+	if constexpr (profile) {
+		prof.label_ms = elapsed_ms(start) - prof.threshold_ms;
+		prof.components = static_cast<int64_t>(num_components);
+		for (size_t label = 0; label < num_components; ++label) {
+			prof.foreground += scratch.stats[label].area;
+			prof.largest = std::max(prof.largest, scratch.stats[label].area);
+		}
+		start = profile_clock::now();
+	}
+
+	/* a negative factor marks a discarded component */
+	if (d->target != tgBackground)
+		filter_components<filter_mode, reverse>(ctx.stats(), num_components, length, fade, fade_factors);
+	else
+		fade_factors.assign(num_components, 1.0);
+	if (d->hysteresis)
+		discard_unseeded(srcptr, srcStride, d->get_thresh_high<pixel_t>(), scratch, fade_factors, seeded);
+	if (d->packed_mask)
+		setPackedMask(scratch, fade_factors.data(), vsapi->getFrameWidth(src, plane), vsapi->getFrameHeight(src, plane), d->roi, plane, props, vsapi);
+
+	/* a plane that needs no write-back is taken from the source or the zero frame */
+	PlaneOutput output = poWritten;
+	if (d->target == tgForeground && !roi)
+		output = unwritten_output<binarize, pixel_t>(srcptr, srcStride, width, height, bits, thresh, fade_factors.data(), num_components);
+	if (output == poWritten)
+		ccl_write<pixel_t>(ctx, srcptr, dstptr, srcStride, width, bits, binarize);
+
+	if constexpr (profile)
+		prof.write_ms = elapsed_ms(start);
+
+	/* holes use the complementary connectivity and the same predicate */
+	if (d->target != tgForeground) {
+		if constexpr (profile)
+			start = profile_clock::now();
+		const size_t num_holes = label_background(scratch, width, height, d->dir_count != 8, holes, d->pool.get());
+		if (roi)
+			offset_stats(holes.stats.data(), num_holes, d->roi.left, d->roi.top);
+		if constexpr (profile) {
+			prof.label_ms += elapsed_ms(start);
+			start = profile_clock::now();
+		}
+		filter_components<filter_mode, reverse>(holes.stats.data(), num_holes, length, fade, fade_factors);
+		fill_components<pixel_t>(dstptr, srcStride, bits, holes, fade_factors.data(), d->pool.get());
+		if constexpr (profile)
+			prof.write_ms += elapsed_ms(start);
+	}
+
+	/* measured before trimming, what the frame needed */
+	if constexpr (profile) {
+		prof.scratch_bytes = static_cast<int64_t>(scratch.bytes() + holes.bytes() + (fade_factors.capacity() * sizeof(double)) + seeded.capacity());
+		setProfileProps(prof, plane, props, vsapi);
+		d->profile->add(prof);
+	}
+
+	if (d->target != tgForeground)
+		holes.trim();
+	ctx.trim();
+	return output;
+}
+
+// temporal=1: labels the frame from prev, the state of the previous one, and
+// relabels only around the band of rows whose mask changed. Returns false,
+// leaving dst unwritten, when nothing changed and prev's output can be shared.
+// next receives this frame's state.
+template<int filter_mode, bool binarize, bool reverse, typename pixel_t>
+bool process_c_temporal(const VSFrame* src, const VSFrame* prev_src, VSFrame* dst, int bits, const TMCData* d, const std::shared_ptr<TemporalState>& prev, std::shared_ptr<TemporalState>& next, const VSAPI* vsapi) {
+	const pixel_t* srcptr = reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(src, 0));
+	pixel_t* VS_RESTRICT dstptr = reinterpret_cast<pixel_t*>(vsapi->getWritePtr(dst, 0));
+	const int srcStride = vsapi->getStride(src, 0) / sizeof(pixel_t);
+	const int height = vsapi->getFrameHeight(src, 0);
+	const int width = vsapi->getFrameWidth(src, 0);
+
+	const pixel_t thresh = d->get_thresh<pixel_t>();
+	const auto length = d->length;
+	const auto fade = d->fade;
+
+	next = d->temporal->acquire(vsapi);
+	CCLContext& ctx = next->ctx;
+	ctx.kernels = d->kernels;
+	ctx.pool = d->pool.get();
+	CCLScratch& s = ctx.scratch;
+
+	if (!prev) {
+		ccl_label<pixel_t>(ctx, srcptr, srcStride, width, height, thresh, d->dir_count == 8, d->threads);
+	}
+	else {
+		threshold_plane<pixel_t>(*d->kernels, srcptr, srcStride, width, height, thresh, s.bitmap);
+		int y0, y1;
+		changed_rows(prev->ctx.scratch.bitmap, s.bitmap, y0, y1);
+
+		/* kept pixels carry their source value, so changed values dirty a row too */
+		if constexpr (!binarize) {
+			const pixel_t* prevptr = reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(prev_src, 0));
+			const CCLScratch& p = prev->ctx.scratch;
+			for (int y = 0; y < height; ++y) {
+				if (y >= y0 && y < y1) continue;
+				for (uint32_t i = p.row_start[y]; i < p.row_start[y + 1]; ++i) {
+					const Run& run = p.runs[i];
+					const size_t offset = static_cast<size_t>(srcStride) * y + run.x0;
+					if (memcmp(srcptr + offset, prevptr + offset, (run.x1 - run.x0 + 1) * sizeof(pixel_t)) == 0) continue;
+					if (y0 == y1)
+						y0 = y;
+					y0 = std::min(y0, y);
+					y1 = std::max(y1, y + 1);
+					break;
 				}
 			}
 		}
+
+		if (y0 == y1) {
+			d->temporal->recycle(std::move(next));
+			next = prev;
+			return false;
+		}
+		s.strip_y = prev->ctx.scratch.strip_y;
+		ctx.num_components = relabel_band(*d->kernels, prev->ctx.scratch, y0, y1, d->dir_count == 8, s);
+	}
+	/* only the bitmap, runs, ids and stats are read by the next frame */
+	s.strip_runs.clear();
+
+	filter_components<filter_mode, reverse>(ctx.stats(), ctx.num_components, length, fade, ctx.fade_factors);
+
+	ccl_write<pixel_t>(ctx, srcptr, dstptr, srcStride, width, bits, binarize);
+	trim_capacity(ctx.fade_factors, ctx.fade_factors.size());
+	return true;
+}
+
+// Keeps components matching all (or any) of d->constraints, all evaluated on
+// the stats of a single labelling pass. reverse discards them instead.
+template<bool binarize, bool reverse, typename pixel_t>
+PlaneOutput process_c_constraints(const VSFrame* src, VSFrame* dst, VSMap* props, int plane, int bits, const TMCData* d, const FrameParams& fp, const VSAPI* vsapi) {
+	const pixel_t* srcptr = reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(src, plane));
+	pixel_t* VS_RESTRICT dstptr = reinterpret_cast<pixel_t*>(vsapi->getWritePtr(dst, plane));
+	const int srcStride = vsapi->getStride(src, plane) / sizeof(pixel_t);
+	int height = vsapi->getFrameHeight(src, plane);
+	int width = vsapi->getFrameWidth(src, plane);
+
+	thread_local CCLContext ctx;
+	thread_local CCLScratch holes;
+	thread_local std::vector<uint8_t> seeded;
+	ctx.kernels = d->kernels;
+	ctx.pool = d->pool.get();
+	CCLScratch& scratch = ctx.scratch;
+	std::vector<double>& fade_factors = ctx.fade_factors;
+
+	const bool roi = d->roi.width > 0;
+	if (roi) {
+		write_outside_roi<pixel_t>(srcptr, dstptr, srcStride, width, height, d->roi, d->roi_copy);
+		srcptr += srcStride * d->roi.top + d->roi.left;
+		dstptr += srcStride * d->roi.top + d->roi.left;
+		width = d->roi.width;
+		height = d->roi.height;
+	}
+
+	const pixel_t thresh = fp.get_thresh<pixel_t>();
+	const size_t num_components = ccl_label<pixel_t>(ctx, srcptr, srcStride, width, height, thresh, d->dir_count == 8, d->threads);
+	if (roi)
+		offset_stats(scratch.stats.data(), num_components, d->roi.left, d->roi.top);
+
+	fade_factors.resize(num_components);
+	for (size_t label = 0; label < num_components; ++label) {
+		const bool match = component_matches(scratch.stats[label], d->constraints.data(), d->constraints.size(), d->constraints_any);
+		fade_factors[label] = (d->target == tgBackground || match != reverse) ? 1.0 : -1.0;
+	}
+	if (d->hysteresis)
+		discard_unseeded(srcptr, srcStride, d->get_thresh_high<pixel_t>(), scratch, fade_factors, seeded);
+	if (d->packed_mask)
+		setPackedMask(scratch, fade_factors.data(), vsapi->getFrameWidth(src, plane), vsapi->getFrameHeight(src, plane), d->roi, plane, props, vsapi);
+
+	PlaneOutput output = poWritten;
+	if (d->target == tgForeground && !roi)
+		output = unwritten_output<binarize, pixel_t>(srcptr, srcStride, width, height, bits, thresh, fade_factors.data(), num_components);
+	if (output == poWritten)
+		ccl_write<pixel_t>(ctx, srcptr, dstptr, srcStride, width, bits, binarize);
+
+	if (d->target != tgForeground) {
+		const size_t num_holes = label_background(scratch, width, height, d->dir_count != 8, holes, d->pool.get());
+		if (roi)
+			offset_stats(holes.stats.data(), num_holes, d->roi.left, d->roi.top);
+		fade_factors.resize(num_holes);
+		for (size_t label = 0; label < num_holes; ++label) {
+			const bool match = component_matches(holes.stats[label], d->constraints.data(), d->constraints.size(), d->constraints_any);
+			fade_factors[label] = (match != reverse) ? 1.0 : -1.0;
+		}
+		fill_components<pixel_t>(dstptr, srcStride, bits, holes, fade_factors.data(), d->pool.get());
+		holes.trim();
+	}
+	ctx.trim();
+	return output;
+}
+
+// output_format="gray8": process_c writing an 8-bit plane. Fade factors are
+// turned into 0-255 levels once per component rather than multiplied in per
+// pixel.
+template<int filter_mode, bool binarize, bool reverse, typename pixel_t>
+PlaneOutput process_c_gray8(const VSFrame* src, VSFrame* dst, VSMap* props, int plane, int bits, const TMCData* d, const FrameParams& fp, const VSAPI* vsapi) {
+	const pixel_t* srcptr = reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(src, plane));
+	uint8_t* VS_RESTRICT dstptr = vsapi->getWritePtr(dst, plane);
+	const int srcStride = vsapi->getStride(src, plane) / sizeof(pixel_t);
+	const int dstStride = static_cast<int>(vsapi->getStride(dst, plane));
+	const int height = vsapi->getFrameHeight(src, plane);
+	const int width = vsapi->getFrameWidth(src, plane);
+
+	thread_local CCLContext ctx;
+	thread_local std::vector<uint8_t> levels;
+	thread_local std::vector<uint8_t> seeded;
+	ctx.kernels = d->kernels;
+	ctx.pool = d->pool.get();
+	const CCLScratch& scratch = ctx.scratch;
+	std::vector<double>& fade_factors = ctx.fade_factors;
+
+	const auto length = fp.length;
+	const auto fade = fp.fade;
+
+	const size_t num_components = ccl_label<pixel_t>(ctx, srcptr, srcStride, width, height, fp.get_thresh<pixel_t>(), d->dir_count == 8, d->threads);
+
+	filter_components<filter_mode, reverse>(ctx.stats(), num_components, length, fade, fade_factors);
+	if (d->hysteresis)
+		discard_unseeded(srcptr, srcStride, d->get_thresh_high<pixel_t>(), scratch, fade_factors, seeded);
+	if (d->packed_mask)
+		setPackedMask(scratch, fade_factors.data(), vsapi->getFrameWidth(src, plane), vsapi->getFrameHeight(src, plane), d->roi, plane, props, vsapi);
+
+	/* truncated like an 8-bit clip's peak * factor */
+	levels.resize(num_components);
+	for (size_t label = 0; label < num_components; ++label) {
+		levels[label] = fade_factors[label] > 0.0 ? static_cast<uint8_t>(255 * fade_factors[label]) : 0;
+	}
+
+	write_components_gray8<binarize, pixel_t>(srcptr, dstptr, srcStride, dstStride, width, bits, scratch, fade_factors.data(), levels.data(), ctx.pool);
+
+	ctx.trim();
+	trim_capacity(levels, levels.size());
+	return poWritten;
+}
+
+// Zero frame of d, made on first use.
+static const VSFrame* zeroFrame(TMCData* d, const VSFrame* src, VSCore* core, const VSAPI* vsapi) {
+	std::lock_guard<std::mutex> guard(d->zero.lock);
+	if (!d->zero.frame) {
+		const VSVideoFormat* fi = vsapi->getVideoFrameFormat(src);
+		VSFrame* frame = vsapi->newVideoFrame(fi, vsapi->getFrameWidth(src, 0), vsapi->getFrameHeight(src, 0), nullptr, core);
+		for (int plane = 0; plane < fi->numPlanes; ++plane) {
+			memset(vsapi->getWritePtr(frame, plane), 0, vsapi->getStride(frame, plane) * vsapi->getFrameHeight(frame, plane));
+		}
+		d->zero.frame = frame;
+	}
+	return d->zero.frame;
+}
+
+// Output frame once process_planes() has run: dst, or a frame that takes the
+// planes it left unwritten from src or the zero frame, and the rest and the
+// props from dst. When every plane is src's and dst has no props of its own,
+// src itself.
+static const VSFrame* shareUnwrittenPlanes(VSFrame* dst, const VSFrame* src, const PlaneOutput* outputs, TMCData* d, VSCore* core, const VSAPI* vsapi) {
+	bool written = true, source = true;
+	for (int plane : d->planes) {
+		written &= outputs[plane] == poWritten;
+		source &= outputs[plane] == poSource;
+	}
+	if (written)
+		return dst;
+
+	/* the source frame lacks the props profile and packed_mask set on dst */
+	if (source && !d->profile && !d->packed_mask) {
+		vsapi->freeFrame(dst);
+		return vsapi->addFrameRef(src);
+	}
+
+	/* planes that are not processed are references to src's in dst already */
+	const VSFrame* fr[] = { dst, dst, dst };
+	for (int plane : d->planes) {
+		if (outputs[plane] == poSource)
+			fr[plane] = src;
+		else if (outputs[plane] == poZero)
+			fr[plane] = zeroFrame(d, src, core, vsapi);
 	}
+	const int pl[] = { 0, 1, 2 };
+	const VSFrame* out = vsapi->newVideoFrame2(vsapi->getVideoFrameFormat(src), vsapi->getFrameWidth(src, 0), vsapi->getFrameHeight(src, 0), fr, pl, dst, core);
+	vsapi->freeFrame(dst);
+	return out;
 }
 
 static const VSFrame* VS_CC TMCGetFrame(int n, int activationReason, void* instanceData, void** frameData, VSFrameContext* frameCtx, VSCore* core, const VSAPI* vsapi) {
@@ -155,6 +568,8 @@ static const VSFrame* VS_CC TMCGetFrame(int n, int activationReason, void* insta
 
 	if (activationReason == arInitial) {
 		vsapi->requestFrameFilter(n, d->node, frameCtx);
+		if (d->temporal && n > 0)
+			vsapi->requestFrameFilter(n - 1, d->node, frameCtx);
 	}
 	else if (activationReason == arAllFramesReady) {
 #ifdef VS_TARGET_CPU_X86
@@ -164,20 +579,59 @@ static const VSFrame* VS_CC TMCGetFrame(int n, int activationReason, void* insta
 		const VSVideoFormat* fi = vsapi->getVideoFrameFormat(src);
 		int height = vsapi->getFrameHeight(src, 0);
 		int width = vsapi->getFrameWidth(src, 0);
-		const VSFrame* fr[] = { nullptr, src, src };
+		/* unselected planes are copied */
+		const VSFrame* fr[] = { src, src, src };
+		for (int plane : d->planes) {
+			fr[plane] = nullptr;
+		}
 		const int pl[] = { 0, 1, 2 };
-		VSFrame* dst = vsapi->newVideoFrame2(fi, width, height, fr, pl, src, core);
+		VSFrame* dst = d->output_format == ofGray8 ? vsapi->newVideoFrame(&d->out_vi.format, width, height, src, core) : vsapi->newVideoFrame2(fi, width, height, fr, pl, src, core);
 		int bits = d->vi->format.bitsPerSample;
+		/* planes are made writable here rather than by concurrent plane jobs */
+		if (d->planes.size() > 1) {
+			for (int plane : d->planes) {
+				vsapi->getWritePtr(dst, plane);
+			}
+		}
+
+		const VSFrame* out = dst;
+		/* freed after the catch, so an exception doesn't leak it */
+		const VSFrame* prev_src = nullptr;
 
 		try {
-			d->process_c_func(src, dst, bits, d, vsapi);
+			if (d->temporal) {
+				prev_src = n > 0 ? vsapi->getFrameFilter(n - 1, d->node, frameCtx) : nullptr;
+				auto prev = n > 0 ? d->temporal->take(n - 1) : nullptr;
+				std::shared_ptr<TemporalState> next;
+				const bool changed = d->process_temporal_func(src, prev_src, dst, bits, d, prev, next, vsapi);
+
+				/* an unchanged mask reuses plane 0 of the previous output */
+				if (changed) {
+					next->out = vsapi->addFrameRef(dst);
+				}
+				else {
+					vsapi->freeFrame(dst);
+					const VSFrame* shared[] = { next->out, src, src };
+					dst = vsapi->newVideoFrame2(fi, width, height, shared, pl, src, core);
+				}
+				out = dst;
+				d->temporal->put(n, std::move(next));
+				/* a changed frame supersedes prev, whose buffers the next frame can reuse */
+				d->temporal->recycle(std::move(prev));
+			}
+			else {
+				PlaneOutput outputs[3] = { poWritten, poWritten, poWritten };
+				process_planes(src, dst, bits, d, getFrameParams(src, d, vsapi), vsapi, outputs);
+				out = shareUnwrittenPlanes(dst, src, outputs, d, core, vsapi);
+			}
 		}
 		catch (const std::exception& e) {
 			vsapi->setFilterError((std::string("TMaskCleanerMod error: ") + e.what()).c_str(), frameCtx);
 		}
 
+		vsapi->freeFrame(prev_src);
 		vsapi->freeFrame(src);
-		return dst;
+		return out;
 	}
 	return nullptr;
 }
@@ -200,15 +654,30 @@ void VS_CC TMCCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core,
 		auto thresh = static_cast<float>(vsapi->mapGetFloat(in, "thresh", 0, &err));
 		if (err)
 			thresh = (d->vi->format.sampleType == stInteger) ? 235 << (d->vi->format.bitsPerSample - 8) : 1.0f;
+		else if (vsapi->mapNumElements(in, "thresh_low") > 0)
+			throw std::string("thresh and thresh_low cannot both be set.");
+
+		/* thresh_low is thresh under its hysteresis name */
+		const auto thresh_low = static_cast<float>(vsapi->mapGetFloat(in, "thresh_low", 0, &err));
+		if (!err)
+			thresh = thresh_low;
+
+		auto thresh_high = static_cast<float>(vsapi->mapGetFloat(in, "thresh_high", 0, &err));
+		d->hysteresis = !err;
+		if (err)
+			thresh_high = thresh;
 
 		if (d->vi->format.bytesPerSample == 1) {
 			d->set_thresh<uint8_t>(static_cast<uint8_t>(std::clamp(thresh, 0.0f, 255.0f)));
+			d->set_thresh_high<uint8_t>(static_cast<uint8_t>(std::clamp(thresh_high, 0.0f, 255.0f)));
 		}
 		else if (d->vi->format.bytesPerSample == 2) {
 			d->set_thresh<uint16_t>(static_cast<uint16_t>(std::clamp(thresh, 0.0f, 65535.0f)));
+			d->set_thresh_high<uint16_t>(static_cast<uint16_t>(std::clamp(thresh_high, 0.0f, 65535.0f)));
 		}
 		else {
 			d->set_thresh<float>(thresh);
+			d->set_thresh_high<float>(thresh_high);
 		}
 
 		d->fade = static_cast<unsigned int>(vsapi->mapGetInt(in, "fade", 0, &err));
@@ -231,12 +700,122 @@ void VS_CC TMCCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core,
 		if (err)
 			mode = 0;
 
+		const int num_modes = std::max(vsapi->mapNumElements(in, "mode"), 1);
+		const int num_mins = vsapi->mapNumElements(in, "min");
+		const int num_maxs = vsapi->mapNumElements(in, "max");
+		if (num_modes > 1 || num_mins > 0 || num_maxs > 0) {
+			if ((num_mins > 0 && num_mins != num_modes) || (num_maxs > 0 && num_maxs != num_modes))
+				throw std::string("min and max must have one entry per mode.");
+
+			for (int i = 0; i < num_modes; ++i) {
+				Constraint c;
+				c.mode = static_cast<int>(vsapi->mapGetInt(in, "mode", i, &err));
+				if (err)
+					c.mode = 0;
+				c.min = num_mins > 0 ? vsapi->mapGetInt(in, "min", i, nullptr) : 0;
+				c.max = num_maxs > 0 ? vsapi->mapGetInt(in, "max", i, nullptr) : INT64_MAX;
+				if (c.mode < 0 || c.mode > 8)
+					throw std::string("mode must be in the range [0, 8].");
+				if (c.min > c.max)
+					throw std::string("min must not exceed max.");
+				d->constraints.push_back(c);
+			}
+		}
+
+		const char* combine = vsapi->mapGetData(in, "combine", 0, &err);
+		if (err)
+			combine = "and";
+		if (strcmp(combine, "and") == 0)
+			d->constraints_any = false;
+		else if (strcmp(combine, "or") == 0)
+			d->constraints_any = true;
+		else
+			throw std::string("combine must be either \"and\" or \"or\".");
+
+		const char* target = vsapi->mapGetData(in, "target", 0, &err);
+		if (err)
+			target = "foreground";
+		if (strcmp(target, "foreground") == 0)
+			d->target = tgForeground;
+		else if (strcmp(target, "background") == 0)
+			d->target = tgBackground;
+		else if (strcmp(target, "both") == 0)
+			d->target = tgBoth;
+		else
+			throw std::string("target must be \"foreground\", \"background\" or \"both\".");
+
+		auto engine = static_cast<int>(vsapi->mapGetInt(in, "engine", 0, &err));
+		if (err)
+			engine = 0;
+
+		d->threads = static_cast<int>(vsapi->mapGetInt(in, "threads", 0, &err));
+		if (err)
+			d->threads = 1;
+
+		auto opt = static_cast<int>(vsapi->mapGetInt(in, "opt", 0, &err));
+		if (err)
+			opt = -1;
+		if (opt < -1 || opt > cpuAVX512)
+			throw std::string("opt must be -1 (auto), 0 (scalar), 1 (sse4.1), 2 (avx2) or 3 (avx512).");
+		d->kernels = select_kernels(opt);
+		if (!d->kernels)
+			throw std::string("opt=" + std::to_string(opt) + " is not supported by this CPU.");
+
+		d->roi = getRoi(in, d->vi, vsapi);
+		d->planes = getPlanes(in, d->vi, d->roi, vsapi);
+		getPropNames(in, d.get(), vsapi);
+
+		const char* output_format = vsapi->mapGetData(in, "output_format", 0, &err);
+		if (err)
+			output_format = "same";
+		if (strcmp(output_format, "same") == 0)
+			d->output_format = ofSame;
+		else if (strcmp(output_format, "gray8") == 0)
+			d->output_format = ofGray8;
+		else
+			throw std::string("output_format must be either \"same\" or \"gray8\".");
+
+		d->out_vi = *d->vi;
+		if (d->output_format == ofGray8 && !vsapi->queryVideoFormat(&d->out_vi.format, cfGray, stInteger, 8, 0, 0, core))
+			throw std::string("failed to create the gray8 output format.");
+
+		d->packed_mask = !!vsapi->mapGetInt(in, "packed_mask", 0, &err);
+		if (err)
+			d->packed_mask = false;
+
+		auto profile = static_cast<bool>(vsapi->mapGetInt(in, "profile", 0, &err));
+		if (err)
+			profile = false;
+		if (profile)
+			d->profile = std::make_unique<ProfileTotals>();
+
+		auto temporal = static_cast<bool>(vsapi->mapGetInt(in, "temporal", 0, &err));
+		if (err)
+			temporal = false;
+		if (temporal) {
+			d->temporal = std::make_unique<TemporalCache>();
+			d->temporal->max_cached = std::max<size_t>(16, 2 * std::thread::hardware_concurrency());
+		}
+
+		const char* outside = vsapi->mapGetData(in, "outside", 0, &err);
+		if (err)
+			outside = "zero";
+		if (strcmp(outside, "zero") == 0)
+			d->roi_copy = false;
+		else if (strcmp(outside, "copy") == 0)
+			d->roi_copy = true;
+		else
+			throw std::string("outside must be either \"zero\" or \"copy\".");
+
 		if (d->length <= 0)
 			throw std::string("length must be greater than zero.");
 
 		if (thresh <= 0 && d->vi->format.bytesPerSample < 4)
 			throw std::string("thresh must be greater than zero for 8-16bit clip.");
 
+		if (d->hysteresis && thresh_high < thresh)
+			throw std::string("thresh_high must not be below thresh_low.");
+
 		if (d->fade < 0)
 			throw std::string("fade cannot be negative.");
 
@@ -246,6 +825,54 @@ void VS_CC TMCCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core,
 		if (mode < 0 || mode > 8)
 			throw std::string("mode must be in the range [0, 8].");
 
+		if (engine != 0 && engine != 1)
+			throw std::string("engine must be either 0 (runs) or 1 (floodfill).");
+
+		if (!d->constraints.empty() && d->fade > 0)
+			throw std::string("fade is not supported with multiple modes or min/max.");
+
+		if (!d->constraints.empty() && engine != 0)
+			throw std::string("multiple modes or min/max require engine=0.");
+
+		if (d->hysteresis && engine != 0)
+			throw std::string("thresh_high requires engine=0.");
+
+		if (d->hysteresis && d->target == tgBackground)
+			throw std::string("thresh_high requires target \"foreground\" or \"both\".");
+
+		if (d->target != tgForeground && engine != 0)
+			throw std::string("target \"background\" and \"both\" require engine=0.");
+
+		if (d->target != tgForeground && d->fade > 0)
+			throw std::string("fade is not supported with target \"background\" or \"both\".");
+
+		if (d->roi.width > 0 && engine != 0)
+			throw std::string("left, top, width and height require engine=0.");
+
+		if (temporal && (engine != 0 || !d->constraints.empty() || d->hysteresis || d->target != tgForeground || d->roi.width > 0 || d->planes != std::vector<int>{ 0 }))
+			throw std::string("temporal=1 requires engine=0 and a single mode on plane 0, without min/max, thresh_high, a background target or a window.");
+
+		if ((!d->length_prop.empty() || !d->fade_prop.empty()) && !d->constraints.empty())
+			throw std::string("length_prop and fade_prop are not supported with multiple modes or min/max.");
+
+		if (!d->fade_prop.empty() && d->target != tgForeground)
+			throw std::string("fade_prop is not supported with target \"background\" or \"both\".");
+
+		if (temporal && (!d->thresh_prop.empty() || !d->length_prop.empty() || !d->fade_prop.empty()))
+			throw std::string("temporal=1 does not support thresh_prop, length_prop or fade_prop.");
+
+		if (d->output_format == ofGray8 && (engine != 0 || !d->constraints.empty() || d->target != tgForeground || d->roi.width > 0 || temporal || profile || d->planes != std::vector<int>{ 0 }))
+			throw std::string("output_format=\"gray8\" requires engine=0 and a single mode on plane 0, without min/max, a background target, a window, temporal or profile.");
+
+		if (d->packed_mask && (engine != 0 || d->target != tgForeground || temporal))
+			throw std::string("packed_mask=1 requires engine=0 and target \"foreground\", without temporal.");
+
+		if (profile && (engine != 0 || !d->constraints.empty() || temporal))
+			throw std::string("profile=1 requires engine=0 and a single mode, without min/max or temporal.");
+
+		if (d->threads < 1)
+			throw std::string("threads must be at least 1.");
+
 		if (connectivity == 4) {
 			d->directions = directions4;
 			d->dir_count = 4;
@@ -262,18 +889,18 @@ void VS_CC TMCCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core,
 
 		//                              <binarize, reverse, data_type>
 		switch (selector) {
-		case 0b0000: setProcessFunction<false, false, uint8_t>(d.get(), mode); break;
-		case 0b0001: setProcessFunction<false, false, uint16_t>(d.get(), mode); break;
-		case 0b0011: setProcessFunction<false, false, float>(d.get(), mode); break;
-		case 0b0100: setProcessFunction<false, true, uint8_t>(d.get(), mode); break;
-		case 0b0101: setProcessFunction<false, true, uint16_t>(d.get(), mode); break;
-		case 0b0111: setProcessFunction<false, true, float>(d.get(), mode); break;
-		case 0b1000: setProcessFunction<true, false, uint8_t>(d.get(), mode); break;
-		case 0b1001: setProcessFunction<true, false, uint16_t>(d.get(), mode); break;
-		case 0b1011: setProcessFunction<true, false, float>(d.get(), mode); break;
-		case 0b1100: setProcessFunction<true, true, uint8_t>(d.get(), mode); break;
-		case 0b1101: setProcessFunction<true, true, uint16_t>(d.get(), mode); break;
-		case 0b1111: setProcessFunction<true, true, float>(d.get(), mode); break;
+		case 0b0000: setProcessFunction<false, false, uint8_t>(d.get(), mode, engine); break;
+		case 0b0001: setProcessFunction<false, false, uint16_t>(d.get(), mode, engine); break;
+		case 0b0011: setProcessFunction<false, false, float>(d.get(), mode, engine); break;
+		case 0b0100: setProcessFunction<false, true, uint8_t>(d.get(), mode, engine); break;
+		case 0b0101: setProcessFunction<false, true, uint16_t>(d.get(), mode, engine); break;
+		case 0b0111: setProcessFunction<false, true, float>(d.get(), mode, engine); break;
+		case 0b1000: setProcessFunction<true, false, uint8_t>(d.get(), mode, engine); break;
+		case 0b1001: setProcessFunction<true, false, uint16_t>(d.get(), mode, engine); break;
+		case 0b1011: setProcessFunction<true, false, float>(d.get(), mode, engine); break;
+		case 0b1100: setProcessFunction<true, true, uint8_t>(d.get(), mode, engine); break;
+		case 0b1101: setProcessFunction<true, true, uint16_t>(d.get(), mode, engine); break;
+		case 0b1111: setProcessFunction<true, true, float>(d.get(), mode, engine); break;
 		default: throw std::string("Unsupported combination of parameters");
 		}
 	}
@@ -283,7 +910,10 @@ void VS_CC TMCCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core,
 		return;
 	}
 
-	VSFilterDependency deps[] = { {d->node, rpStrictSpatial} };
-	vsapi->createVideoFilter(out, "TMaskCleanerMod", d->vi, TMCGetFrame, FilterFree, fmParallel, deps, 1, d.get(), core);
+	createPool(d.get());
+
+	/* temporal=1 also requests the previous frame */
+	VSFilterDependency deps[] = { {d->node, d->temporal ? rpGeneral : rpStrictSpatial} };
+	vsapi->createVideoFilter(out, "TMaskCleanerMod", &d->out_vi, TMCGetFrame, FilterFree, fmParallel, deps, 1, d.get(), core);
 	d.release();
 }
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+inline int ctz64(uint64_t value) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, value);
+	return static_cast<int>(index);
+#else
+	return __builtin_ctzll(value);
+#endif
+}
+
+// Words [begin, end) of a bitmap row, outside which the row is known to be zero.
+struct WordSpan {
+	uint32_t begin;
+	uint32_t end;
+};
+
+// 1 bit per pixel foreground plane. Every row is framed by a zero word on the
+// left and right and the plane by a zero row above and below, so neighbour
+// lookups at x = -1, x = width, y = -1 and y = height need no bounds checks.
+struct Bitmap {
+	std::vector<uint64_t> bits;
+	int width = 0;
+	int height = 0;
+	size_t words = 0;
+	size_t stride = 0;
+	// per-row occupancy, so empty rows and the empty ends of sparse rows are
+	// skipped without touching their words
+	std::vector<WordSpan> spans;
+
+	// Padding stays zero between frames, interior words are fully rewritten
+	// by threshold_rows().
+	void reset(int w, int h) {
+		if (w == width && h == height && !bits.empty())
+			return;
+		width = w;
+		height = h;
+		words = (static_cast<size_t>(w) + 63) >> 6;
+		stride = words + 2;
+		std::vector<uint64_t>(stride * (static_cast<size_t>(h) + 2), 0).swap(bits);
+		std::vector<WordSpan>(h, WordSpan{ 0, 0 }).swap(spans);
+	}
+
+	uint64_t* row(int y) {
+		return bits.data() + stride * (y + 1) + 1;
+	}
+
+	const uint64_t* row(int y) const {
+		return bits.data() + stride * (y + 1) + 1;
+	}
+
+	bool test(int x, int y) const {
+		return (row(y)[x >> 6] >> (x & 63)) & 1;
+	}
+
+	void clear(int x, int y) {
+		row(y)[x >> 6] &= ~(uint64_t(1) << (x & 63));
+	}
+};
+
+inline WordSpan row_span(const uint64_t* row, size_t words) {
+	size_t begin = 0, end = words;
+	while (begin < end && !row[begin]) ++begin;
+	while (end > begin && !row[end - 1]) --end;
+	return { static_cast<uint32_t>(begin), static_cast<uint32_t>(end) };
+}
@@ -0,0 +1,690 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <limits>
+#include <type_traits>
+#include "kernels.h"
+
+struct ComponentStats {
+	int64_t area;
+	int64_t sum_x;
+	int64_t sum_y;
+	int min_x, min_y;
+	int max_x, max_y;
+};
+
+// Background bounding box, from the rows that are not entirely foreground and
+// the columns that are not (tracked through the AND of those rows). Words
+// outside [col_begin, col_end) are already known to be zero, so once a sparse
+// row has emptied the range no further words are read.
+struct BackgroundBox {
+	std::vector<uint64_t> full_columns;
+	size_t col_begin = 0;
+	size_t col_end = 0;
+	int min_y = 0;
+	int max_y = -1;
+
+	void reset(size_t words, int height) {
+		full_columns.assign(words, ~uint64_t(0));
+		col_begin = 0;
+		col_end = words;
+		min_y = height;
+		max_y = -1;
+	}
+
+	void add_row(const Kernels& k, int y, const uint64_t* row, WordSpan span, bool full) {
+		if (full) return;
+		min_y = std::min(min_y, y);
+		max_y = y;
+		col_begin = std::max<size_t>(col_begin, span.begin);
+		col_end = std::min<size_t>(col_end, span.end);
+		if (col_begin < col_end)
+			k.and_words(full_columns.data(), row, col_begin, col_end);
+	}
+
+	// min_x = width, max_x = -1 when every column is foreground
+	void columns(int width, int& min_x, int& max_x) const {
+		min_x = width;
+		max_x = -1;
+		if (max_y < 0) return;
+		for (int x = 0; x < width; ++x) {
+			const size_t wi = static_cast<size_t>(x >> 6);
+			if (wi < col_begin || wi >= col_end || !((full_columns[wi] >> (x & 63)) & 1)) {
+				min_x = std::min(min_x, x);
+				max_x = x;
+			}
+		}
+	}
+};
+
+// Releases the capacity a buffer kept from an earlier, denser frame once it is
+// well past what the current frame needed, so idle workers don't pin their peak.
+template<typename T>
+inline void trim_capacity(std::vector<T>& v, size_t needed) {
+	if (v.capacity() > 4 * needed + 16384 / sizeof(T)) {
+		std::vector<T> trimmed;
+		trimmed.reserve(needed);
+		trimmed.assign(v.begin(), v.begin() + std::min(needed, v.size()));
+		v.swap(trimmed);
+	}
+}
+
+// Per-thread labelling state. For a w x h plane it is bounded by
+//   bitmap:               (ceil(w / 64) + 2) * (h + 2) words
+//   runs, parent, stats:  at most ceil(w / 2) * h entries each
+//   strip_runs:           the same runs again when threads > 1
+// i.e. O(w * h) words whatever the mask content, and trim() drops anything a
+// denser earlier frame left behind.
+struct CCLScratch {
+	Bitmap bitmap;
+	std::vector<Run> runs;
+	std::vector<uint32_t> row_start;
+	std::vector<uint32_t> parent;
+	std::vector<ComponentStats> stats;
+	// horizontal strips [strip_y[i], strip_y[i + 1]) used by the last label_plane()
+	std::vector<int> strip_y;
+	std::vector<std::vector<Run>> strip_runs;
+
+	// heap bytes held, for profile=1
+	size_t bytes() const {
+		size_t total = bitmap.bits.capacity() * sizeof(uint64_t) + bitmap.spans.capacity() * sizeof(WordSpan) +
+			runs.capacity() * sizeof(Run) + (row_start.capacity() + parent.capacity()) * sizeof(uint32_t) +
+			stats.capacity() * sizeof(ComponentStats);
+		for (const auto& strip : strip_runs) {
+			total += strip.capacity() * sizeof(Run);
+		}
+		return total;
+	}
+
+	void trim() {
+		trim_capacity(runs, runs.size());
+		trim_capacity(parent, parent.size());
+		trim_capacity(stats, stats.size());
+		for (auto& strip : strip_runs) {
+			trim_capacity(strip, strip.size());
+		}
+	}
+};
+
+using profile_clock = std::chrono::steady_clock;
+
+inline double elapsed_ms(profile_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(profile_clock::now() - start).count();
+}
+
+// Threads kept for the lifetime of a filter instance, so that the per-thread
+// scratch of the work they run survives from one frame to the next. The
+// indices of a batch are claimed by the caller and the workers alike, and the
+// caller only waits for indices someone has started, so a batch run from
+// inside another one (planes, then strips of a plane) cannot deadlock.
+class WorkerPool {
+public:
+	explicit WorkerPool(int workers) {
+		threads.reserve(std::max(workers, 0));
+		for (int i = 0; i < workers; ++i) {
+			threads.emplace_back([this] { work(); });
+		}
+	}
+
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stop = true;
+		}
+		wake.notify_all();
+		for (auto& thread : threads) {
+			thread.join();
+		}
+	}
+
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+	int size() const { return static_cast<int>(threads.size()); }
+
+	// Runs fn(0) .. fn(count - 1) and rethrows the first exception any threw.
+	template<typename F>
+	void run(int count, F& fn) {
+		Batch batch;
+		batch.call = [](void* f, int i) { (*static_cast<F*>(f))(i); };
+		batch.fn = &fn;
+		batch.count = count;
+
+		std::unique_lock<std::mutex> guard(lock);
+		queue.push_back(&batch);
+		for (int i = 1; i < count && i <= size(); ++i) {
+			wake.notify_one();
+		}
+		while (batch.next < batch.count) {
+			execute(batch, guard);
+		}
+		finished.wait(guard, [&] { return batch.done == batch.count; });
+		guard.unlock();
+
+		if (batch.error)
+			std::rethrow_exception(batch.error);
+	}
+
+private:
+	struct Batch {
+		void (*call)(void*, int);
+		void* fn;
+		int count;
+		// guarded by lock
+		int next = 0;
+		int done = 0;
+		std::exception_ptr error;
+	};
+
+	// Claims the next index of batch and runs it unlocked. Once done is
+	// counted the batch may be gone, it is not touched again.
+	void execute(Batch& batch, std::unique_lock<std::mutex>& guard) {
+		const int i = batch.next++;
+		if (batch.next == batch.count)
+			queue.erase(std::find(queue.begin(), queue.end(), &batch));
+		guard.unlock();
+		std::exception_ptr error;
+		try {
+			batch.call(batch.fn, i);
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+		guard.lock();
+		if (error && !batch.error)
+			batch.error = error;
+		if (++batch.done == batch.count)
+			finished.notify_all();
+	}
+
+	void work() {
+		std::unique_lock<std::mutex> guard(lock);
+		for (;;) {
+			wake.wait(guard, [this] { return stop || !queue.empty(); });
+			if (queue.empty())
+				return;
+			execute(*queue.front(), guard);
+		}
+	}
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable finished;
+	std::deque<Batch*> queue;
+	bool stop = false;
+	std::vector<std::thread> threads;
+};
+
+// Runs fn(0) .. fn(count - 1), fn(0) on the calling thread, on pool's workers.
+// Without a pool, threads are started for the call.
+template<typename F>
+inline void parallel_for(WorkerPool* pool, int count, F&& fn) {
+	if (count == 1) {
+		fn(0);
+		return;
+	}
+	if (pool) {
+		pool->run(count, fn);
+		return;
+	}
+	std::vector<std::thread> workers;
+	workers.reserve(count - 1);
+	for (int i = 1; i < count; ++i) {
+		workers.emplace_back([&fn, i] { fn(i); });
+	}
+	fn(0);
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
+
+template<typename pixel_t>
+inline void threshold_rows(const Kernels& k, const pixel_t* srcptr, ptrdiff_t stride, pixel_t thresh, int y0, int y1, Bitmap& bitmap) {
+	const auto threshold_row = k.pixel<pixel_t>().threshold_row;
+	for (int y = y0; y < y1; ++y) {
+		uint64_t* row = bitmap.row(y);
+		threshold_row(srcptr + stride * y, bitmap.width, thresh, row);
+		bitmap.spans[y] = row_span(row, bitmap.words);
+	}
+}
+
+template<typename pixel_t>
+inline void threshold_plane(const Kernels& k, const pixel_t* srcptr, ptrdiff_t stride, int width, int height, pixel_t thresh, Bitmap& bitmap) {
+	bitmap.reset(width, height);
+	threshold_rows<pixel_t>(k, srcptr, stride, thresh, 0, height, bitmap);
+}
+
+// Appends the runs of one thresholded row to out, reading only the words in span.
+inline void extract_row_runs(const Kernels& k, const uint64_t* row, WordSpan span, int width, int y, std::vector<Run>& out) {
+	if (span.begin == span.end) return;
+	const size_t count = out.size();
+	out.resize(count + ((static_cast<size_t>(span.end - span.begin) << 6) + 1) / 2);
+	out.resize(count + k.row_runs(row, span, width, y, out.data() + count));
+}
+
+// Appends the runs of rows [y0, y1) to out and stores the running count after
+// each row in row_end[y].
+inline void extract_runs(const Kernels& k, const Bitmap& bitmap, int y0, int y1, std::vector<Run>& out, uint32_t* row_end) {
+	for (int y = y0; y < y1; ++y) {
+		extract_row_runs(k, bitmap.row(y), bitmap.spans[y], bitmap.width, y, out);
+		row_end[y] = static_cast<uint32_t>(out.size());
+	}
+}
+
+inline uint32_t find_root(uint32_t* parent, uint32_t i) {
+	while (parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+// Links the runs [c, c_end) of one row to the runs [p, p_end) of an earlier one
+// that overlap them horizontally, widened by reach pixels on either side. Roots
+// are always the smallest run index of a component, so parent[i] <= i holds
+// throughout.
+inline void union_overlaps(const Run* runs, uint32_t* parent, uint32_t p, uint32_t p_end, uint32_t c, uint32_t c_end, int reach) {
+	for (; c < c_end && p < p_end; ++c) {
+		while (p < p_end && runs[p].x1 < runs[c].x0 - reach) ++p;
+
+		for (uint32_t q = p; q < p_end && runs[q].x0 <= runs[c].x1 + reach; ++q) {
+			const uint32_t a = find_root(parent, q);
+			const uint32_t b = find_root(parent, c);
+			if (a < b) parent[b] = a;
+			else if (b < a) parent[a] = b;
+		}
+	}
+}
+
+// Links the runs of every row in [y0, y1) to the overlapping runs of the row
+// above.
+inline void union_rows(CCLScratch& s, int y0, int y1, bool eight_connected) {
+	for (int y = std::max(y0, 1); y < y1; ++y) {
+		union_overlaps(s.runs.data(), s.parent.data(), s.row_start[y - 1], s.row_start[y], s.row_start[y], s.row_start[y + 1], eight_connected ? 1 : 0);
+	}
+}
+
+constexpr ComponentStats empty_stats{ 0, 0, 0, INT32_MAX, INT32_MAX, -1, -1 };
+
+inline void add_run(ComponentStats& c, const Run& run) {
+	const int64_t len = run.x1 - run.x0 + 1;
+	c.area += len;
+	c.sum_x += (static_cast<int64_t>(run.x0) + run.x1) * len / 2;
+	c.sum_y += static_cast<int64_t>(run.y) * len;
+	c.min_x = std::min(c.min_x, run.x0);
+	c.max_x = std::max(c.max_x, run.x1);
+	c.min_y = std::min(c.min_y, run.y);
+	c.max_y = std::max(c.max_y, run.y);
+}
+
+// Replaces parent[] with dense component ids in raster order of each component's
+// first pixel, accumulates per-component stats and returns the component count.
+inline size_t resolve_components(CCLScratch& s) {
+	const size_t run_count = s.runs.size();
+	uint32_t* parent = s.parent.data();
+	uint32_t num_components = 0;
+
+	for (size_t i = 0; i < run_count; ++i) {
+		parent[i] = (parent[i] == i) ? num_components++ : parent[parent[i]];
+	}
+
+	s.stats.assign(num_components, empty_stats);
+	for (size_t i = 0; i < run_count; ++i) {
+		add_run(s.stats[parent[i]], s.runs[i]);
+	}
+
+	return num_components;
+}
+
+// Moves stats measured in a window whose top-left corner is (left, top) of the
+// plane into plane coordinates.
+inline void offset_stats(ComponentStats* stats, size_t count, int left, int top) {
+	for (size_t i = 0; i < count; ++i) {
+		ComponentStats& c = stats[i];
+		c.sum_x += c.area * left;
+		c.sum_y += c.area * top;
+		c.min_x += left;
+		c.max_x += left;
+		c.min_y += top;
+		c.max_y += top;
+	}
+}
+
+// Joins the per-strip runs in strip_runs, whose row_start entries are still
+// counted from their strip's start, into one run list: strips are unioned
+// concurrently, then their boundary rows serially, and components resolved.
+inline size_t merge_strips(CCLScratch& s, bool eight_connected, WorkerPool* pool) {
+	const int strips = static_cast<int>(s.strip_y.size()) - 1;
+	uint32_t total = 0;
+	for (int i = 0; i < strips; ++i) {
+		for (int y = s.strip_y[i]; y < s.strip_y[i + 1]; ++y) {
+			s.row_start[y + 1] += total;
+		}
+		total += static_cast<uint32_t>(s.strip_runs[i].size());
+	}
+	s.runs.resize(total);
+	s.parent.resize(total);
+
+	parallel_for(pool, strips, [&](int i) {
+		const int y0 = s.strip_y[i], y1 = s.strip_y[i + 1];
+		const uint32_t offset = s.row_start[y0];
+		std::copy(s.strip_runs[i].begin(), s.strip_runs[i].end(), s.runs.begin() + offset);
+		std::iota(s.parent.begin() + offset, s.parent.begin() + offset + s.strip_runs[i].size(), offset);
+		union_rows(s, y0 + 1, y1, eight_connected);
+	});
+	for (int i = 1; i < strips; ++i) {
+		union_rows(s, s.strip_y[i], s.strip_y[i] + 1, eight_connected);
+	}
+
+	return resolve_components(s);
+}
+
+// Thresholds, labels and measures plane 0. With threads > 1 the plane is split
+// into horizontal strips that are thresholded, run-extracted and unioned
+// concurrently on pool; the strip boundary rows are then unioned serially. Roots stay
+// the smallest run index either way, so labels and stats match the serial path.
+// With profile, threshold_ms receives the time spent thresholding, that of the
+// slowest strip when there are several.
+template<typename pixel_t, bool profile = false>
+inline size_t label_plane(const Kernels& k, const pixel_t* srcptr, ptrdiff_t stride, int width, int height, pixel_t thresh, bool eight_connected, int threads, WorkerPool* pool, CCLScratch& s, double* threshold_ms = nullptr) {
+	const int strips = std::clamp(std::min(threads, height / 64), 1, height > 0 ? height : 1);
+	s.strip_y.resize(static_cast<size_t>(strips) + 1);
+	for (int i = 0; i <= strips; ++i) {
+		s.strip_y[i] = static_cast<int>(static_cast<int64_t>(height) * i / strips);
+	}
+
+	s.bitmap.reset(width, height);
+	s.row_start.resize(static_cast<size_t>(height) + 1);
+	s.row_start[0] = 0;
+
+	if (strips == 1) {
+		[[maybe_unused]] profile_clock::time_point start;
+		if constexpr (profile)
+			start = profile_clock::now();
+		threshold_rows<pixel_t>(k, srcptr, stride, thresh, 0, height, s.bitmap);
+		if constexpr (profile)
+			*threshold_ms = elapsed_ms(start);
+		s.runs.clear();
+		extract_runs(k, s.bitmap, 0, height, s.runs, s.row_start.data() + 1);
+		s.parent.resize(s.runs.size());
+		std::iota(s.parent.begin(), s.parent.end(), 0u);
+		union_rows(s, 0, height, eight_connected);
+		return resolve_components(s);
+	}
+
+	s.strip_runs.resize(strips);
+	std::vector<double> strip_ms(profile ? strips : 0);
+	parallel_for(pool, strips, [&](int i) {
+		const int y0 = s.strip_y[i], y1 = s.strip_y[i + 1];
+		[[maybe_unused]] profile_clock::time_point start;
+		if constexpr (profile)
+			start = profile_clock::now();
+		threshold_rows<pixel_t>(k, srcptr, stride, thresh, y0, y1, s.bitmap);
+		if constexpr (profile)
+			strip_ms[i] = elapsed_ms(start);
+		s.strip_runs[i].clear();
+		extract_runs(k, s.bitmap, y0, y1, s.strip_runs[i], s.row_start.data() + 1);
+	});
+	if constexpr (profile)
+		*threshold_ms = *std::max_element(strip_ms.begin(), strip_ms.end());
+
+	return merge_strips(s, eight_connected, pool);
+}
+
+// Sets [y0, y1) to the rows whose words differ between two bitmaps of the same
+// size, y0 = y1 = 0 when none do.
+inline void changed_rows(const Bitmap& a, const Bitmap& b, int& y0, int& y1) {
+	y0 = y1 = 0;
+	for (int y = 0; y < a.height; ++y) {
+		if (memcmp(a.row(y), b.row(y), a.words * sizeof(uint64_t)) == 0) continue;
+		if (y1 == 0)
+			y0 = y;
+		y1 = y + 1;
+	}
+}
+
+// Labels s, whose bitmap matches that of prev outside rows [y0, y1), reusing
+// prev's runs, ids and stats there. Only the components of prev on rows
+// [y0 - 1, y1 + 1) can be joined or split by the band, so their runs and the
+// band's are unioned again and every other component is carried over as is.
+// Carried components keep the order of prev and are followed by the relabelled
+// ones, rather than raster order. Returns the component count.
+inline size_t relabel_band(const Kernels& k, const CCLScratch& prev, int y0, int y1, bool eight_connected, CCLScratch& s) {
+	const int height = s.bitmap.height;
+	const size_t prev_count = prev.stats.size();
+	constexpr uint32_t unset = UINT32_MAX;
+
+	/* the rows [r0, r1) of everything relabelled */
+	std::vector<uint8_t> affected(prev_count, 0);
+	int r0 = y0, r1 = y1;
+	for (uint32_t i = prev.row_start[std::max(y0 - 1, 0)]; i < prev.row_start[std::min(y1 + 1, height)]; ++i) {
+		const uint32_t label = prev.parent[i];
+		if (affected[label]) continue;
+		affected[label] = 1;
+		r0 = std::min(r0, prev.stats[label].min_y);
+		r1 = std::max(r1, prev.stats[label].max_y + 1);
+	}
+
+	/* rows outside the band are prev's, those after it shifted by the band's new run count */
+	s.row_start.resize(static_cast<size_t>(height) + 1);
+	std::copy(prev.row_start.begin(), prev.row_start.begin() + y0 + 1, s.row_start.begin());
+	s.runs.assign(prev.runs.begin(), prev.runs.begin() + prev.row_start[y0]);
+	extract_runs(k, s.bitmap, y0, y1, s.runs, s.row_start.data() + 1);
+	const uint32_t shift = s.row_start[y1] - prev.row_start[y1];
+	s.runs.insert(s.runs.end(), prev.runs.begin() + prev.row_start[y1], prev.runs.end());
+	for (int y = y1; y < height; ++y) {
+		s.row_start[y + 1] = prev.row_start[y + 1] + shift;
+	}
+
+	s.parent.assign(prev.parent.begin(), prev.parent.begin() + prev.row_start[y0]);
+	s.parent.resize(s.row_start[y1], unset);
+	s.parent.insert(s.parent.end(), prev.parent.begin() + prev.row_start[y1], prev.parent.end());
+
+	std::vector<uint32_t> ids(prev_count);
+	uint32_t num_components = 0;
+	for (size_t label = 0; label < prev_count; ++label) {
+		ids[label] = affected[label] ? unset : num_components++;
+	}
+	s.stats.resize(num_components);
+	for (size_t label = 0; label < prev_count; ++label) {
+		if (!affected[label])
+			s.stats[ids[label]] = prev.stats[label];
+	}
+
+	/* union the region; carried runs in it are linked only among themselves */
+	const uint32_t first = s.row_start[r0], last = s.row_start[r1];
+	std::vector<uint32_t> old_ids(s.parent.begin() + first, s.parent.begin() + last);
+	std::iota(s.parent.begin() + first, s.parent.begin() + last, first);
+	union_rows(s, r0 + 1, r1, eight_connected);
+
+	uint32_t* parent = s.parent.data();
+	for (uint32_t i = 0; i < first; ++i) {
+		parent[i] = ids[parent[i]];
+	}
+	for (uint32_t i = first; i < last; ++i) {
+		const uint32_t old_id = old_ids[i - first];
+		if (old_id != unset && !affected[old_id]) {
+			parent[i] = ids[old_id];
+			continue;
+		}
+		if (parent[i] == i) {
+			parent[i] = num_components++;
+			s.stats.push_back(empty_stats);
+		}
+		else {
+			parent[i] = parent[parent[i]];
+		}
+		add_run(s.stats[parent[i]], s.runs[i]);
+	}
+	for (uint32_t i = last; i < s.parent.size(); ++i) {
+		parent[i] = ids[parent[i]];
+	}
+
+	return num_components;
+}
+
+// Appends the background runs of rows [y0, y1), the gaps between the runs of fg,
+// to out and stores the running count after each row in row_end[y].
+inline void extract_gaps(const CCLScratch& fg, int width, int y0, int y1, std::vector<Run>& out, uint32_t* row_end) {
+	for (int y = y0; y < y1; ++y) {
+		int x = 0;
+		for (uint32_t i = fg.row_start[y]; i < fg.row_start[y + 1]; ++i) {
+			const Run& run = fg.runs[i];
+			if (run.x0 > x)
+				out.push_back({ x, run.x0 - 1, y });
+			x = run.x1 + 1;
+		}
+		if (x < width)
+			out.push_back({ x, width - 1, y });
+		row_end[y] = static_cast<uint32_t>(out.size());
+	}
+}
+
+// Labels the background of a plane already labelled into fg, reusing its runs
+// and strips instead of thresholding again. eight_connected is the background's
+// own connectivity, normally the complement of the foreground's.
+inline size_t label_background(const CCLScratch& fg, int width, int height, bool eight_connected, CCLScratch& s, WorkerPool* pool) {
+	const int strips = static_cast<int>(fg.strip_y.size()) - 1;
+	s.strip_y = fg.strip_y;
+	s.row_start.resize(static_cast<size_t>(height) + 1);
+	s.row_start[0] = 0;
+
+	if (strips == 1) {
+		s.runs.clear();
+		extract_gaps(fg, width, 0, height, s.runs, s.row_start.data() + 1);
+		s.parent.resize(s.runs.size());
+		std::iota(s.parent.begin(), s.parent.end(), 0u);
+		union_rows(s, 0, height, eight_connected);
+		return resolve_components(s);
+	}
+
+	s.strip_runs.resize(strips);
+	parallel_for(pool, strips, [&](int i) {
+		s.strip_runs[i].clear();
+		extract_gaps(fg, width, s.strip_y[i], s.strip_y[i + 1], s.strip_runs[i], s.row_start.data() + 1);
+	});
+
+	return merge_strips(s, eight_connected, pool);
+}
+
+// Hysteresis seeds: sets seeded[id] when component id has a pixel at or above
+// high. Runs of components already set are skipped, so callers can pre-set the
+// ones they don't need tested, and each run stops at its first seed.
+template<typename pixel_t>
+inline void mark_seeded(const pixel_t* srcptr, ptrdiff_t stride, pixel_t high, const CCLScratch& s, uint8_t* seeded) {
+	for (size_t i = 0; i < s.runs.size(); ++i) {
+		const uint32_t id = s.parent[i];
+		if (seeded[id]) continue;
+
+		const Run& run = s.runs[i];
+		const pixel_t* src = srcptr + stride * run.y;
+		for (int x = run.x0; x <= run.x1; ++x) {
+			/* same comparison as threshold_row, NaN counts as foreground */
+			if (!(src[x] < high)) {
+				seeded[id] = 1;
+				break;
+			}
+		}
+	}
+}
+
+template<int filter_mode>
+inline size_t component_value(const ComponentStats& c) {
+	if constexpr (filter_mode == 0) { // pixel count
+		return c.area;
+	}
+	else if constexpr (filter_mode == 1) { // centriod_x
+		return c.sum_x / c.area;
+	}
+	else if constexpr (filter_mode == 2) { // centriod_y
+		return c.sum_y / c.area;
+	}
+	else if constexpr (filter_mode == 3) { // min_x
+		return c.min_x;
+	}
+	else if constexpr (filter_mode == 4) { // min_y
+		return c.min_y;
+	}
+	else if constexpr (filter_mode == 5) { // max_x
+		return c.max_x;
+	}
+	else if constexpr (filter_mode == 6) { // max_y
+		return c.max_y;
+	}
+	else if constexpr (filter_mode == 7) { // width
+		return c.max_x - c.min_x + 1;
+	}
+	else if constexpr (filter_mode == 8) { // height
+		return c.max_y - c.min_y + 1;
+	}
+}
+
+inline size_t component_value(int mode, const ComponentStats& c) {
+	switch (mode) {
+	case 0: return component_value<0>(c);
+	case 1: return component_value<1>(c);
+	case 2: return component_value<2>(c);
+	case 3: return component_value<3>(c);
+	case 4: return component_value<4>(c);
+	case 5: return component_value<5>(c);
+	case 6: return component_value<6>(c);
+	case 7: return component_value<7>(c);
+	default: return component_value<8>(c);
+	}
+}
+
+// Fade factor applied to a component's pixels, negative when it is discarded.
+template<bool reverse>
+inline double component_factor(size_t value, unsigned int length, unsigned int fade, double fade_inv) {
+	bool should_draw;
+	double fade_factor = 1.0;
+	if constexpr (!reverse) {
+		should_draw = (value >= length);
+		if (should_draw && fade > 0 && (value - length <= fade)) {
+			fade_factor = (value - length) * fade_inv;
+		}
+	}
+	else {
+		should_draw = (value <= length);
+		if (should_draw && fade > 0 && (length - value <= fade)) {
+			fade_factor = (length - value) * fade_inv;
+		}
+	}
+	return should_draw ? fade_factor : -1.0;
+}
+
+// min <= value(mode) <= max
+struct Constraint {
+	int mode;
+	int64_t min;
+	int64_t max;
+};
+
+inline bool component_matches(const ComponentStats& c, const Constraint* constraints, size_t count, bool match_any) {
+	for (size_t i = 0; i < count; ++i) {
+		const int64_t value = static_cast<int64_t>(component_value(constraints[i].mode, c));
+		const bool hit = value >= constraints[i].min && value <= constraints[i].max;
+		if (hit == match_any)
+			return match_any;
+	}
+	return !match_any;
+}
+
+inline void merge_intensity(IntensityStats& a, const IntensityStats& b) {
+	a.sum += b.sum;
+	a.sum_x += b.sum_x;
+	a.sum_y += b.sum_y;
+	a.min = std::min(a.min, b.min);
+	a.max = std::max(a.max, b.max);
+}
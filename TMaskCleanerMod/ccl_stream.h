@@ -0,0 +1,197 @@
+#pragma once
+
+#include "ccl.h"
+
+// Stats-only labeller that works a row at a time. Only the runs of the
+// previous and current row are kept, tagged with compact ids of the components
+// that are still open. Each row builds a small equivalence table over those ids
+// and the new runs; components accumulate straight into their slot of `stats`,
+// which is handed out in raster order of the component's first pixel, so
+// closing a component needs no extra work and no final sort. Memory is
+// O(width + components), with no full-frame bitmap or run list.
+struct CCLStream {
+	std::vector<uint64_t> row;
+	std::vector<Run> prev_runs;
+	std::vector<Run> cur_runs;
+	std::vector<uint32_t> prev_ids;
+	std::vector<uint32_t> cur_ids;
+	// equivalence table over the open ids and the runs of the new row, and the
+	// slot of each open id
+	std::vector<uint32_t> parent;
+	std::vector<uint32_t> slots;
+	std::vector<uint32_t> next_slots;
+	std::vector<uint32_t> remap;
+	// one slot per component started so far, area -1 once merged into an
+	// earlier one
+	std::vector<ComponentStats> stats;
+	size_t dead_slots = 0;
+	BackgroundBox background;
+	// parallel to stats when intensity stats are requested
+	unsigned intensity_stats = 0;
+	std::vector<IntensityStats> intensity;
+	IntensityStats background_intensity;
+	// slot of each run of the last row, for measure_row
+	std::vector<uint32_t> row_ids;
+
+	void trim() {
+		trim_capacity(stats, stats.size());
+		trim_capacity(intensity, intensity.size());
+	}
+};
+
+// Drops the slots of merged components, keeping the order of the rest.
+inline void compact_slots(CCLStream& s) {
+	s.remap.resize(s.stats.size());
+	uint32_t kept = 0;
+	for (size_t i = 0; i < s.stats.size(); ++i) {
+		s.remap[i] = kept;
+		if (s.stats[i].area >= 0) {
+			if (s.intensity_stats)
+				s.intensity[kept] = s.intensity[i];
+			s.stats[kept++] = s.stats[i];
+		}
+	}
+	s.stats.resize(kept);
+	if (s.intensity_stats)
+		s.intensity.resize(kept);
+	for (auto& slot : s.slots) {
+		slot = s.remap[slot];
+	}
+	s.dead_slots = 0;
+}
+
+// Joins the runs of the new row to the open components. Runs never join each
+// other directly, so every set's root is either an open id or a run that
+// starts a new component. Open ids that no run reaches are closed.
+inline void stream_row(CCLStream& s, bool eight_connected) {
+	const uint32_t num_open = static_cast<uint32_t>(s.slots.size());
+	const size_t prev_count = s.prev_runs.size();
+	const size_t cur_count = s.cur_runs.size();
+	const int reach = eight_connected ? 1 : 0;
+
+	s.parent.resize(num_open + cur_count);
+	std::iota(s.parent.begin(), s.parent.end(), 0u);
+
+	uint32_t* parent = s.parent.data();
+	size_t p = 0;
+	for (size_t j = 0; j < cur_count && p < prev_count; ++j) {
+		const Run& c = s.cur_runs[j];
+		while (p < prev_count && s.prev_runs[p].x1 < c.x0 - reach) ++p;
+
+		uint32_t b = static_cast<uint32_t>(num_open + j);
+		for (size_t q = p; q < prev_count && s.prev_runs[q].x0 <= c.x1 + reach; ++q) {
+			const uint32_t a = find_root(parent, s.prev_ids[q]);
+			b = find_root(parent, b);
+			if (a == b) continue;
+			const uint32_t root = std::min(a, b), child = std::max(a, b);
+			parent[child] = root;
+			if (child < num_open) {
+				/* two open components meet, the later slot is dropped */
+				uint32_t& keep = s.slots[root];
+				const uint32_t drop = s.slots[child];
+				ComponentStats& k = s.stats[std::min(keep, drop)];
+				ComponentStats& d = s.stats[std::max(keep, drop)];
+				k.area += d.area;
+				k.sum_x += d.sum_x;
+				k.sum_y += d.sum_y;
+				k.min_x = std::min(k.min_x, d.min_x);
+				k.min_y = std::min(k.min_y, d.min_y);
+				k.max_x = std::max(k.max_x, d.max_x);
+				k.max_y = std::max(k.max_y, d.max_y);
+				d.area = -1;
+				if (s.intensity_stats)
+					merge_intensity(s.intensity[std::min(keep, drop)], s.intensity[std::max(keep, drop)]);
+				keep = std::min(keep, drop);
+				++s.dead_slots;
+			}
+		}
+	}
+
+	/* runs are added to their component; components that reach the new row
+	   get compact ids in run order and those that start on it a new slot */
+	s.remap.assign(num_open + cur_count, UINT32_MAX);
+	s.next_slots.clear();
+	s.cur_ids.resize(cur_count);
+	for (size_t j = 0; j < cur_count; ++j) {
+		const Run& run = s.cur_runs[j];
+		const int64_t len = run.x1 - run.x0 + 1;
+		const uint32_t root = find_root(parent, static_cast<uint32_t>(num_open + j));
+
+		if (root >= num_open) {
+			s.cur_ids[j] = static_cast<uint32_t>(s.next_slots.size());
+			s.next_slots.push_back(static_cast<uint32_t>(s.stats.size()));
+			s.stats.push_back({ len, (static_cast<int64_t>(run.x0) + run.x1) * len / 2, static_cast<int64_t>(run.y) * len, run.x0, run.y, run.x1, run.y });
+			if (s.intensity_stats)
+				s.intensity.push_back(empty_intensity);
+			continue;
+		}
+
+		if (s.remap[root] == UINT32_MAX) {
+			s.remap[root] = static_cast<uint32_t>(s.next_slots.size());
+			s.next_slots.push_back(s.slots[root]);
+		}
+		/* rows only grow downwards, min_y is already set */
+		ComponentStats& c = s.stats[s.slots[root]];
+		c.area += len;
+		c.sum_x += (static_cast<int64_t>(run.x0) + run.x1) * len / 2;
+		c.sum_y += static_cast<int64_t>(run.y) * len;
+		c.min_x = std::min(c.min_x, run.x0);
+		c.max_x = std::max(c.max_x, run.x1);
+		c.max_y = run.y;
+		s.cur_ids[j] = s.remap[root];
+	}
+
+	s.slots.swap(s.next_slots);
+	s.prev_runs.swap(s.cur_runs);
+	s.prev_ids.swap(s.cur_ids);
+
+	if (s.dead_slots > 4096 && s.dead_slots * 2 > s.stats.size())
+		compact_slots(s);
+}
+
+// Thresholds and measures plane 0 one row at a time. Stats and their order
+// match label_plane(); the background box, and with intensity_stats set the
+// intensity of every component and the background, are filled as well.
+template<typename pixel_t>
+inline size_t stream_plane(const Kernels& k, const pixel_t* srcptr, ptrdiff_t stride, int width, int height, pixel_t thresh, bool eight_connected, unsigned intensity_stats, CCLStream& s) {
+	const size_t words = (static_cast<size_t>(width) + 63) >> 6;
+	s.row.resize(words);
+	s.prev_runs.clear();
+	s.prev_ids.clear();
+	s.slots.clear();
+	s.stats.clear();
+	s.dead_slots = 0;
+	s.background.reset(words, height);
+	s.intensity_stats = intensity_stats;
+	s.intensity.clear();
+	s.background_intensity = empty_intensity;
+	const PixelKernels<pixel_t>& pk = k.pixel<pixel_t>();
+
+	for (int y = 0; y < height; ++y) {
+		pk.threshold_row(srcptr + stride * y, width, thresh, s.row.data());
+		const WordSpan span = row_span(s.row.data(), words);
+
+		s.cur_runs.clear();
+		extract_row_runs(k, s.row.data(), span, width, y, s.cur_runs);
+
+		int64_t row_area = 0;
+		for (const Run& run : s.cur_runs) {
+			row_area += run.x1 - run.x0 + 1;
+		}
+		s.background.add_row(k, y, s.row.data(), span, row_area == width);
+
+		stream_row(s, eight_connected);
+
+		if (intensity_stats) {
+			s.row_ids.resize(s.prev_runs.size());
+			for (size_t i = 0; i < s.prev_runs.size(); ++i) {
+				s.row_ids[i] = s.slots[s.prev_ids[i]];
+			}
+			pk.measure_row(srcptr + stride * y, width, y, s.prev_runs.data(), s.row_ids.data(), s.prev_runs.size(), intensity_stats, s.intensity.data(), s.background_intensity);
+		}
+	}
+
+	if (s.dead_slots > 0)
+		compact_slots(s);
+	return s.stats.size();
+}
@@ -0,0 +1,83 @@
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define TMCM_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+static void cpuid(unsigned leaf, unsigned subleaf, unsigned regs[4]) {
+#if defined(_MSC_VER)
+	int r[4];
+	__cpuidex(r, static_cast<int>(leaf), static_cast<int>(subleaf));
+	for (int i = 0; i < 4; ++i) {
+		regs[i] = static_cast<unsigned>(r[i]);
+	}
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Register state the OS saves on context switches (XCR0).
+static uint64_t os_state() {
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t lo, hi;
+	__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return (static_cast<uint64_t>(hi) << 32) | lo;
+#endif
+}
+#endif
+
+int cpu_level() {
+#if defined(TMCM_X86)
+	unsigned regs[4];
+	cpuid(0, 0, regs);
+	const unsigned max_leaf = regs[0];
+	if (max_leaf < 1)
+		return cpuScalar;
+
+	cpuid(1, 0, regs);
+	const unsigned ecx1 = regs[2];
+	if (!(ecx1 & (1u << 19))) // SSE4.1
+		return cpuScalar;
+
+	/* AVX state has to be enabled by the OS, not only present */
+	const bool osxsave = ecx1 & (1u << 27);
+	const uint64_t xcr0 = osxsave ? os_state() : 0;
+	if (max_leaf < 7 || !(ecx1 & (1u << 28)) || !(ecx1 & (1u << 12)) || (xcr0 & 0x6) != 0x6) // AVX, FMA, XMM/YMM state
+		return cpuSSE41;
+
+	cpuid(7, 0, regs);
+	const unsigned ebx7 = regs[1];
+	if (!(ebx7 & (1u << 5)) || !(ebx7 & (1u << 3)) || !(ebx7 & (1u << 8))) // AVX2, BMI1, BMI2
+		return cpuSSE41;
+
+	if (!(ebx7 & (1u << 16)) || !(ebx7 & (1u << 30)) || !(ebx7 & (1u << 31)) || (xcr0 & 0xE6) != 0xE6) // AVX-512 F, BW, VL, opmask/ZMM state
+		return cpuAVX2;
+
+	return cpuAVX512;
+#else
+	return cpuScalar;
+#endif
+}
+
+const Kernels* select_kernels(int opt) {
+	const int level = cpu_level();
+	if (opt < 0)
+		opt = level;
+	if (opt > level)
+		return nullptr;
+
+	switch (opt) {
+#if defined(TMCM_X86)
+	case cpuAVX512: return &kernels_avx512;
+	case cpuAVX2: return &kernels_avx2;
+	case cpuSSE41: return &kernels_sse41;
+#endif
+	default: return &kernels_scalar;
+	}
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <limits>
+#include "bitmap.h"
+
+// A horizontal run of foreground pixels [x0, x1] on row y.
+struct Run {
+	int x0;
+	int x1;
+	int y;
+};
+
+// Optional per-component statistics of the source values, selected per filter.
+enum IntensityStat : unsigned {
+	isSum = 1 << 0,
+	isMean = 1 << 1,
+	isMin = 1 << 2,
+	isMax = 1 << 3,
+	isCentroid = 1 << 4, // intensity-weighted centroid
+};
+
+struct IntensityStats {
+	double sum;
+	double sum_x; // sum of value * x
+	double sum_y; // sum of value * y
+	double min;
+	double max;
+};
+
+constexpr IntensityStats empty_intensity = { 0.0, 0.0, 0.0, std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity() };
+
+// Instruction set levels with their own kernel build, lowest first. The values
+// are those of the `opt` parameter.
+enum CpuLevel : int {
+	cpuScalar = 0,
+	cpuSSE41 = 1,
+	cpuAVX2 = 2,
+	cpuAVX512 = 3,
+};
+
+template<typename pixel_t>
+struct PixelKernels {
+	// Sets bit x of dst when !(src[x] < thresh), so NaN counts as foreground.
+	// Bits past width are left zero.
+	void (*threshold_row)(const pixel_t* src, int width, pixel_t thresh, uint64_t* dst);
+	// Writes runs[0..count) whose factors[ids[i]] is not negative: peak * factor
+	// with [1] (binarize), the source scaled by the factor with [0].
+	void (*write_runs[2])(const pixel_t* src, pixel_t* dst, ptrdiff_t stride, float peak, const Run* runs, const uint32_t* ids, size_t count, const double* factors);
+	// Measures one row: run i goes to components[ids[i]], the gaps between runs
+	// to background, running only the loops that `which` needs.
+	void (*measure_row)(const pixel_t* src, int width, int y, const Run* runs, const uint32_t* ids, size_t count, unsigned which, IntensityStats* components, IntensityStats& background);
+};
+
+// Hot loops, built once per CpuLevel by kernels_*.cpp with that level's flags
+// and picked at create time. They only take raw buffers, so none of the inline
+// code shared with the rest of the plugin is instantiated under wider flags.
+struct Kernels {
+	const char* name;
+	PixelKernels<uint8_t> u8;
+	PixelKernels<uint16_t> u16;
+	PixelKernels<float> f32;
+	// Writes the runs of one thresholded row to out, reading only the words in
+	// span, and returns their count. out needs room for (width + 1) / 2 runs.
+	size_t (*row_runs)(const uint64_t* row, WordSpan span, int width, int y, Run* out);
+	// acc[i] &= row[i] for i in [begin, end)
+	void (*and_words)(uint64_t* acc, const uint64_t* row, size_t begin, size_t end);
+
+	template<typename pixel_t>
+	const PixelKernels<pixel_t>& pixel() const {
+		if constexpr (std::is_same_v<pixel_t, uint8_t>) {
+			return u8;
+		}
+		else if constexpr (std::is_same_v<pixel_t, uint16_t>) {
+			return u16;
+		}
+		else {
+			return f32;
+		}
+	}
+};
+
+extern const Kernels kernels_scalar;
+extern const Kernels kernels_sse41;
+extern const Kernels kernels_avx2;
+extern const Kernels kernels_avx512;
+
+// Highest CpuLevel the CPU and OS support, from cpuid.
+int cpu_level();
+
+// Kernels for opt, or for cpu_level() when opt is negative. nullptr when the
+// CPU does not support opt.
+const Kernels* select_kernels(int opt);
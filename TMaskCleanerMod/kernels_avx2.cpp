@@ -0,0 +1,6 @@
+// Built with -mavx2 -mfma -mbmi -mbmi2 (/arch:AVX2), see meson.build.
+#define TMCM_ISA 2
+#define TMCM_ISA_NAME "avx2"
+#define KERNEL_NS kernels_avx2_impl
+#define KERNEL_TABLE kernels_avx2
+#include "kernels_impl.h"
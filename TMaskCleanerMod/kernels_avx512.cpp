@@ -0,0 +1,6 @@
+// Built with -mavx512f -mavx512bw -mavx512vl (/arch:AVX512), see meson.build.
+#define TMCM_ISA 3
+#define TMCM_ISA_NAME "avx512"
+#define KERNEL_NS kernels_avx512_impl
+#define KERNEL_TABLE kernels_avx512
+#include "kernels_impl.h"
@@ -0,0 +1,279 @@
+// Kernel bodies, compiled once per CpuLevel by kernels_*.cpp. Each of them sets
+//   TMCM_ISA      its CpuLevel, as a plain number for #if
+//   KERNEL_NS     a namespace of its own, so inline code compiled with wider
+//                 flags can never be merged into another level's build
+//   KERNEL_TABLE  the name of its Kernels table
+//   TMCM_ISA_NAME its name in messages
+// before including this file. Only raw loops live here: no std algorithms or
+// containers, whose shared instantiations could be picked by the linker from
+// the wrong translation unit.
+
+#include <cstring>
+#include "kernels.h"
+#if TMCM_ISA > 0
+#include <immintrin.h>
+#endif
+
+namespace KERNEL_NS {
+
+// ctz64() of bitmap.h, kept per level for the same reason.
+static inline int ctz(uint64_t value) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, value);
+	return static_cast<int>(index);
+#else
+	return __builtin_ctzll(value);
+#endif
+}
+
+template<typename pixel_t>
+static void threshold_row(const pixel_t* src, int width, pixel_t thresh, uint64_t* dst) {
+	int x = 0;
+
+#if TMCM_ISA >= 3
+	if constexpr (std::is_same_v<pixel_t, uint8_t>) {
+		const __m512i t = _mm512_set1_epi8(static_cast<char>(thresh));
+		for (; x + 64 <= width; x += 64) {
+			dst[x >> 6] = _mm512_cmpge_epu8_mask(_mm512_loadu_si512(src + x), t);
+		}
+	}
+	else if constexpr (std::is_same_v<pixel_t, uint16_t>) {
+		const __m512i t = _mm512_set1_epi16(static_cast<short>(thresh));
+		for (; x + 64 <= width; x += 64) {
+			const uint64_t lo = _mm512_cmpge_epu16_mask(_mm512_loadu_si512(src + x), t);
+			const uint64_t hi = _mm512_cmpge_epu16_mask(_mm512_loadu_si512(src + x + 32), t);
+			dst[x >> 6] = lo | (hi << 32);
+		}
+	}
+	else {
+		const __m512 t = _mm512_set1_ps(thresh);
+		for (; x + 64 <= width; x += 64) {
+			uint64_t word = 0;
+			for (int k = 0; k < 4; ++k) {
+				word |= static_cast<uint64_t>(_mm512_cmp_ps_mask(_mm512_loadu_ps(src + x + 16 * k), t, _CMP_NLT_UQ)) << (16 * k);
+			}
+			dst[x >> 6] = word;
+		}
+	}
+#elif TMCM_ISA >= 2
+	if constexpr (std::is_same_v<pixel_t, uint8_t>) {
+		const __m256i t = _mm256_set1_epi8(static_cast<char>(thresh));
+		for (; x + 64 <= width; x += 64) {
+			const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x));
+			const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x + 32));
+			const uint32_t lo = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(a, t), a)));
+			const uint32_t hi = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(b, t), b)));
+			dst[x >> 6] = lo | (static_cast<uint64_t>(hi) << 32);
+		}
+	}
+	else if constexpr (std::is_same_v<pixel_t, uint16_t>) {
+		const __m256i t = _mm256_set1_epi16(static_cast<short>(thresh));
+		for (; x + 64 <= width; x += 64) {
+			uint64_t word = 0;
+			for (int k = 0; k < 2; ++k) {
+				const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x + 32 * k));
+				const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x + 32 * k + 16));
+				const __m256i ma = _mm256_cmpeq_epi16(_mm256_max_epu16(a, t), a);
+				const __m256i mb = _mm256_cmpeq_epi16(_mm256_max_epu16(b, t), b);
+				const __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(ma, mb), 0xD8);
+				word |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(packed))) << (32 * k);
+			}
+			dst[x >> 6] = word;
+		}
+	}
+	else {
+		const __m256 t = _mm256_set1_ps(thresh);
+		for (; x + 64 <= width; x += 64) {
+			uint64_t word = 0;
+			for (int k = 0; k < 8; ++k) {
+				const __m256 v = _mm256_loadu_ps(src + x + 8 * k);
+				word |= static_cast<uint64_t>(_mm256_movemask_ps(_mm256_cmp_ps(v, t, _CMP_NLT_UQ))) << (8 * k);
+			}
+			dst[x >> 6] = word;
+		}
+	}
+#elif TMCM_ISA >= 1
+	if constexpr (std::is_same_v<pixel_t, uint8_t>) {
+		const __m128i t = _mm_set1_epi8(static_cast<char>(thresh));
+		for (; x + 64 <= width; x += 64) {
+			uint64_t word = 0;
+			for (int k = 0; k < 4; ++k) {
+				const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x + 16 * k));
+				word |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(a, t), a)))) << (16 * k);
+			}
+			dst[x >> 6] = word;
+		}
+	}
+	else if constexpr (std::is_same_v<pixel_t, uint16_t>) {
+		const __m128i t = _mm_set1_epi16(static_cast<short>(thresh));
+		for (; x + 64 <= width; x += 64) {
+			uint64_t word = 0;
+			for (int k = 0; k < 4; ++k) {
+				const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x + 16 * k));
+				const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x + 16 * k + 8));
+				const __m128i ma = _mm_cmpeq_epi16(_mm_max_epu16(a, t), a);
+				const __m128i mb = _mm_cmpeq_epi16(_mm_max_epu16(b, t), b);
+				word |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(_mm_packs_epi16(ma, mb)))) << (16 * k);
+			}
+			dst[x >> 6] = word;
+		}
+	}
+	else {
+		const __m128 t = _mm_set1_ps(thresh);
+		for (; x + 64 <= width; x += 64) {
+			uint64_t word = 0;
+			for (int k = 0; k < 16; ++k) {
+				word |= static_cast<uint64_t>(_mm_movemask_ps(_mm_cmpnlt_ps(_mm_loadu_ps(src + x + 4 * k), t))) << (4 * k);
+			}
+			dst[x >> 6] = word;
+		}
+	}
+#endif
+
+	for (; x < width; x += 64) {
+		const int count = width - x < 64 ? width - x : 64;
+		uint64_t word = 0;
+		for (int k = 0; k < count; ++k) {
+			word |= static_cast<uint64_t>(!(src[x + k] < thresh)) << k;
+		}
+		dst[x >> 6] = word;
+	}
+}
+
+static size_t row_runs(const uint64_t* row, WordSpan span, int width, int y, Run* out) {
+	size_t count = 0;
+	bool in_run = false;
+	int x0 = 0;
+
+	for (size_t wi = span.begin; wi < span.end; ++wi) {
+		uint64_t word = row[wi];
+		const int base = static_cast<int>(wi << 6);
+
+		if (in_run) {
+			if (word == ~uint64_t(0)) continue;
+			const int end = ctz(~word);
+			out[count++] = { x0, base + end - 1, y };
+			in_run = false;
+			word &= ~uint64_t(0) << end;
+		}
+
+		while (word) {
+			const int start = ctz(word);
+			const uint64_t gaps = ~word & (~uint64_t(0) << start);
+			if (!gaps) {
+				x0 = base + start;
+				in_run = true;
+				break;
+			}
+			const int end = ctz(gaps);
+			out[count++] = { base + start, base + end - 1, y };
+			word &= ~uint64_t(0) << end;
+		}
+	}
+
+	if (in_run) {
+		const int span_end = static_cast<int>(span.end << 6);
+		out[count++] = { x0, (width < span_end ? width : span_end) - 1, y };
+	}
+	return count;
+}
+
+static void and_words(uint64_t* acc, const uint64_t* row, size_t begin, size_t end) {
+	for (size_t wi = begin; wi < end; ++wi) {
+		acc[wi] &= row[wi];
+	}
+}
+
+template<bool binarize, typename pixel_t>
+static void write_runs(const pixel_t* src, pixel_t* dst, ptrdiff_t stride, float peak, const Run* runs, const uint32_t* ids, size_t count, const double* factors) {
+	for (size_t i = 0; i < count; ++i) {
+		const double fade_factor = factors[ids[i]];
+		if (fade_factor < 0.0) continue;
+
+		const Run& run = runs[i];
+		const pixel_t* s = src + stride * run.y;
+		pixel_t* dd = dst + stride * run.y;
+
+		if constexpr (binarize) {
+			const pixel_t value = peak * fade_factor;
+			for (int x = run.x0; x <= run.x1; ++x) {
+				dd[x] = value;
+			}
+		}
+		else if (fade_factor == 1.0) {
+			memcpy(dd + run.x0, s + run.x0, sizeof(pixel_t) * (run.x1 - run.x0 + 1));
+		}
+		else {
+			for (int x = run.x0; x <= run.x1; ++x) {
+				dd[x] = s[x] * fade_factor;
+			}
+		}
+	}
+}
+
+// Adds src[x0..x1] on row y to is, running only the loops that `which` needs.
+template<typename pixel_t>
+static void measure_span(const pixel_t* src, int x0, int x1, int y, unsigned which, IntensityStats& is) {
+	using acc_t = std::conditional_t<std::is_floating_point_v<pixel_t>, double, int64_t>;
+
+	if (which & isCentroid) {
+		acc_t sum = 0, sum_x = 0;
+		for (int x = x0; x <= x1; ++x) {
+			sum += src[x];
+			sum_x += static_cast<acc_t>(src[x]) * x;
+		}
+		is.sum += static_cast<double>(sum);
+		is.sum_x += static_cast<double>(sum_x);
+		is.sum_y += static_cast<double>(sum) * y;
+	}
+	else if (which & (isSum | isMean)) {
+		acc_t sum = 0;
+		for (int x = x0; x <= x1; ++x) {
+			sum += src[x];
+		}
+		is.sum += static_cast<double>(sum);
+	}
+
+	/* same selection as std::min / std::max, NaN never replaces a value */
+	if (which & (isMin | isMax)) {
+		pixel_t lo = src[x0], hi = src[x0];
+		for (int x = x0 + 1; x <= x1; ++x) {
+			lo = src[x] < lo ? src[x] : lo;
+			hi = hi < src[x] ? src[x] : hi;
+		}
+		is.min = static_cast<double>(lo) < is.min ? static_cast<double>(lo) : is.min;
+		is.max = is.max < static_cast<double>(hi) ? static_cast<double>(hi) : is.max;
+	}
+}
+
+template<typename pixel_t>
+static void measure_row(const pixel_t* src, int width, int y, const Run* runs, const uint32_t* ids, size_t count, unsigned which, IntensityStats* components, IntensityStats& background) {
+	int x = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (runs[i].x0 > x)
+			measure_span<pixel_t>(src, x, runs[i].x0 - 1, y, which, background);
+		measure_span<pixel_t>(src, runs[i].x0, runs[i].x1, y, which, components[ids[i]]);
+		x = runs[i].x1 + 1;
+	}
+	if (x < width)
+		measure_span<pixel_t>(src, x, width - 1, y, which, background);
+}
+
+template<typename pixel_t>
+constexpr PixelKernels<pixel_t> pixel_kernels = {
+	&threshold_row<pixel_t>,
+	{ &write_runs<false, pixel_t>, &write_runs<true, pixel_t> },
+	&measure_row<pixel_t>,
+};
+
+} // namespace KERNEL_NS
+
+const Kernels KERNEL_TABLE = {
+	TMCM_ISA_NAME,
+	KERNEL_NS::pixel_kernels<uint8_t>,
+	KERNEL_NS::pixel_kernels<uint16_t>,
+	KERNEL_NS::pixel_kernels<float>,
+	&KERNEL_NS::row_runs,
+	&KERNEL_NS::and_words,
+};
@@ -0,0 +1,6 @@
+// Built with no ISA flags, see meson.build.
+#define TMCM_ISA 0
+#define TMCM_ISA_NAME "scalar"
+#define KERNEL_NS kernels_scalar_impl
+#define KERNEL_TABLE kernels_scalar
+#include "kernels_impl.h"
@@ -0,0 +1,6 @@
+// Built with -msse4.1, see meson.build.
+#define TMCM_ISA 1
+#define TMCM_ISA_NAME "sse4.1"
+#define KERNEL_NS kernels_sse41_impl
+#define KERNEL_TABLE kernels_sse41
+#include "kernels_impl.h"
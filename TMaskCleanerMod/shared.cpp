@@ -1,29 +1,341 @@
 #include "shared.h"
 
-static void VS_CC FilterFree(void* instanceData, VSCore* core, const VSAPI* vsapi) {
+void VS_CC FilterFree(void* instanceData, VSCore* core, const VSAPI* vsapi) {
 	auto d{ static_cast<TMCData*>(instanceData) };
+	if (d->profile && d->profile->frames > 0)
+		vsapi->logMessage(mtInformation, d->profile->summary().c_str(), core);
+	d->pool.reset();
+	vsapi->freeFrame(d->zero.frame);
 	vsapi->freeNode(d->node);
 	delete d;
 }
 
+void ProfileTotals::add(const FrameProfile& p) {
+	const double frame_ms = p.threshold_ms + p.label_ms + p.write_ms;
+	int decade = 0;
+	for (int64_t count = p.components; count > 0 && decade < 7; count /= 10) {
+		++decade;
+	}
+	int octave = 0;
+	for (double ms = frame_ms; ms >= 1.0 && octave < 10; ms /= 2) {
+		++octave;
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	++frames;
+	threshold_ms += p.threshold_ms;
+	label_ms += p.label_ms;
+	write_ms += p.write_ms;
+	max_frame_ms = std::max(max_frame_ms, frame_ms);
+	max_components = std::max(max_components, p.components);
+	max_largest = std::max(max_largest, p.largest);
+	max_scratch_bytes = std::max(max_scratch_bytes, p.scratch_bytes);
+	++components_histogram[decade];
+	++time_histogram[octave];
+}
+
+std::string ProfileTotals::summary() const {
+	char line[512];
+	snprintf(line, sizeof(line), "TMaskCleanerMod profile: %lld frames, %.3f ms threshold, %.3f ms label, %.3f ms write per frame, slowest %.3f ms; at most %lld components, largest %lld pixels, %lld scratch bytes",
+		static_cast<long long>(frames), threshold_ms / frames, label_ms / frames, write_ms / frames, max_frame_ms,
+		static_cast<long long>(max_components), static_cast<long long>(max_largest), static_cast<long long>(max_scratch_bytes));
+	std::string out = line;
+
+	out += "\ncomponents per frame:";
+	for (int i = 0; i < 8; ++i) {
+		if (!components_histogram[i]) continue;
+		if (i == 0)
+			snprintf(line, sizeof(line), " 0: %lld", static_cast<long long>(components_histogram[i]));
+		else
+			snprintf(line, sizeof(line), " %s%.0f: %lld", i == 7 ? ">=" : "<", std::pow(10.0, i == 7 ? 6 : i), static_cast<long long>(components_histogram[i]));
+		out += line;
+	}
+	out += "\nms per frame:";
+	for (int i = 0; i < 11; ++i) {
+		if (!time_histogram[i]) continue;
+		snprintf(line, sizeof(line), " %s%d: %lld", i == 10 ? ">=" : "<", 1 << (i == 10 ? 9 : i), static_cast<long long>(time_histogram[i]));
+		out += line;
+	}
+	return out;
+}
+
+void setProfileProps(const FrameProfile& p, int plane, VSMap* props, const VSAPI* vsapi) {
+	vsapi->mapSetFloat(props, plane_key("_TMCProfileThresholdMs", plane).c_str(), p.threshold_ms, maReplace);
+	vsapi->mapSetFloat(props, plane_key("_TMCProfileLabelMs", plane).c_str(), p.label_ms, maReplace);
+	vsapi->mapSetFloat(props, plane_key("_TMCProfileWriteMs", plane).c_str(), p.write_ms, maReplace);
+	vsapi->mapSetInt(props, plane_key("_TMCProfileComponents", plane).c_str(), p.components, maReplace);
+	vsapi->mapSetInt(props, plane_key("_TMCProfileForeground", plane).c_str(), p.foreground, maReplace);
+	vsapi->mapSetInt(props, plane_key("_TMCProfileLargest", plane).c_str(), p.largest, maReplace);
+	vsapi->mapSetInt(props, plane_key("_TMCProfileScratchBytes", plane).c_str(), p.scratch_bytes, maReplace);
+}
+
+// packed_mask=1: the pixels of plane kept from scratch's components, as
+// packed by pack_kept(), in _TMCMaskPacked.
+void setPackedMask(const CCLScratch& scratch, const double* fade_factors, int width, int height, const Roi& roi, int plane, VSMap* props, const VSAPI* vsapi) {
+	thread_local std::vector<uint8_t> packed;
+	pack_kept(scratch, fade_factors, width, height, roi.left, roi.top, packed);
+	vsapi->mapSetData(props, plane_key("_TMCMaskPacked", plane).c_str(), reinterpret_cast<const char*>(packed.data()), static_cast<int>(packed.size()), dtBinary, maReplace);
+	trim_capacity(packed, packed.size());
+}
+
+Roi getRoi(const VSMap* in, const VSVideoInfo* vi, const VSAPI* vsapi) {
+	int err{ 0 };
+	Roi roi{};
+
+	roi.left = static_cast<int>(vsapi->mapGetInt(in, "left", 0, &err));
+	if (err)
+		roi.left = 0;
+
+	roi.top = static_cast<int>(vsapi->mapGetInt(in, "top", 0, &err));
+	if (err)
+		roi.top = 0;
+
+	roi.width = static_cast<int>(vsapi->mapGetInt(in, "width", 0, &err));
+	if (err)
+		roi.width = vi->width - roi.left;
+
+	roi.height = static_cast<int>(vsapi->mapGetInt(in, "height", 0, &err));
+	if (err)
+		roi.height = vi->height - roi.top;
+
+	if (roi.left < 0 || roi.top < 0 || roi.width <= 0 || roi.height <= 0 || roi.left + roi.width > vi->width || roi.top + roi.height > vi->height)
+		throw std::string("left, top, width and height must describe a non-empty window inside the frame.");
+
+	/* the whole frame needs no window */
+	if (roi.width == vi->width && roi.height == vi->height)
+		return Roi{};
+	return roi;
+}
+
+std::vector<int> getPlanes(const VSMap* in, const VSVideoInfo* vi, const Roi& roi, const VSAPI* vsapi) {
+	const int num_planes = vsapi->mapNumElements(in, "planes");
+	if (num_planes <= 0)
+		return { 0 };
+
+	std::vector<int> planes;
+	for (int i = 0; i < num_planes; ++i) {
+		const int plane = static_cast<int>(vsapi->mapGetInt(in, "planes", i, nullptr));
+		if (plane < 0 || plane >= vi->format.numPlanes)
+			throw std::string("planes must only contain plane indices of the clip.");
+		if (std::find(planes.begin(), planes.end(), plane) != planes.end())
+			throw std::string("planes must not contain a plane twice.");
+		planes.push_back(plane);
+	}
+
+	/* the window is in plane 0 coordinates */
+	const bool subsampled = vi->format.subSamplingW > 0 || vi->format.subSamplingH > 0;
+	if (roi.width > 0 && subsampled && planes != std::vector<int>{ 0 })
+		throw std::string("left, top, width and height require planes without subsampling.");
+	return planes;
+}
+
+void process_planes(const VSFrame* src, VSFrame* dst, int bits, const TMCData* d, const FrameParams& fp, const VSAPI* vsapi, PlaneOutput* outputs) {
+	PlaneOutput unused[3];
+	if (!outputs)
+		outputs = unused;
+
+	VSMap* props = vsapi->getFramePropertiesRW(dst);
+	if (d->planes.size() == 1) {
+		outputs[d->planes[0]] = d->process_c_func(src, dst, props, d->planes[0], bits, d, fp, vsapi);
+		return;
+	}
+
+	/* frame props are not safe to set concurrently, every job gets a map of
+	   its own that is merged into dst's once all are done */
+	const int count = static_cast<int>(d->planes.size());
+	std::vector<VSMap*> maps(count);
+	std::vector<std::exception_ptr> errors(count);
+	for (int i = 0; i < count; ++i) {
+		maps[i] = vsapi->createMap();
+	}
+	parallel_for(d->pool.get(), count, [&](int i) {
+		try {
+			outputs[d->planes[i]] = d->process_c_func(src, dst, maps[i], d->planes[i], bits, d, fp, vsapi);
+		}
+		catch (...) {
+			errors[i] = std::current_exception();
+		}
+	});
+	for (int i = 0; i < count; ++i) {
+		vsapi->copyMap(maps[i], props);
+		vsapi->freeMap(maps[i]);
+	}
+	for (const auto& error : errors) {
+		if (error)
+			std::rethrow_exception(error);
+	}
+}
+
+void createPool(TMCData* d) {
+	/* the calling thread takes a share of every batch */
+	const int workers = std::max(d->threads, static_cast<int>(d->planes.size())) - 1;
+	if (workers > 0)
+		d->pool = std::make_unique<WorkerPool>(workers);
+}
+
+void getPropNames(const VSMap* in, TMCData* d, const VSAPI* vsapi) {
+	int err{ 0 };
+	const char* thresh_prop = vsapi->mapGetData(in, "thresh_prop", 0, &err);
+	if (!err)
+		d->thresh_prop = thresh_prop;
+	const char* length_prop = vsapi->mapGetData(in, "length_prop", 0, &err);
+	if (!err)
+		d->length_prop = length_prop;
+	const char* fade_prop = vsapi->mapGetData(in, "fade_prop", 0, &err);
+	if (!err)
+		d->fade_prop = fade_prop;
+}
+
+// Number in prop name of props, false when name is empty or the frame does
+// not have it.
+static bool getNumberProp(const VSMap* props, const std::string& name, double& value, const VSAPI* vsapi) {
+	if (name.empty())
+		return false;
+	switch (vsapi->mapGetType(props, name.c_str())) {
+	case ptUnset:
+		return false;
+	case ptInt:
+		value = static_cast<double>(vsapi->mapGetInt(props, name.c_str(), 0, nullptr));
+		return true;
+	case ptFloat:
+		value = vsapi->mapGetFloat(props, name.c_str(), 0, nullptr);
+		return true;
+	default:
+		throw std::runtime_error("frame prop " + name + " must be a number.");
+	}
+}
+
+FrameParams getFrameParams(const VSFrame* src, const TMCData* d, const VSAPI* vsapi) {
+	FrameParams fp = d->frame_params();
+	if (d->thresh_prop.empty() && d->length_prop.empty() && d->fade_prop.empty())
+		return fp;
+
+	const VSMap* props = vsapi->getFramePropertiesRO(src);
+	double value;
+	if (getNumberProp(props, d->thresh_prop, value, vsapi)) {
+		const auto thresh = static_cast<float>(value);
+		if (thresh <= 0 && d->vi->format.bytesPerSample < 4)
+			throw std::runtime_error("frame prop " + d->thresh_prop + " must be greater than zero for 8-16bit clip.");
+		if (d->vi->format.bytesPerSample == 1)
+			fp.thresh_typed.set<uint8_t>(static_cast<uint8_t>(std::clamp(thresh, 0.0f, 255.0f)));
+		else if (d->vi->format.bytesPerSample == 2)
+			fp.thresh_typed.set<uint16_t>(static_cast<uint16_t>(std::clamp(thresh, 0.0f, 65535.0f)));
+		else
+			fp.thresh_typed.set<float>(thresh);
+	}
+	if (getNumberProp(props, d->length_prop, value, vsapi)) {
+		if (value < 1 || value > std::numeric_limits<unsigned int>::max())
+			throw std::runtime_error("frame prop " + d->length_prop + " must be greater than zero.");
+		fp.length = static_cast<unsigned int>(value);
+	}
+	if (getNumberProp(props, d->fade_prop, value, vsapi)) {
+		if (value < 0 || value > std::numeric_limits<unsigned int>::max())
+			throw std::runtime_error("frame prop " + d->fade_prop + " cannot be negative.");
+		fp.fade = static_cast<unsigned int>(value);
+	}
+	return fp;
+}
+
 VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin* plugin, const VSPLUGINAPI* vspapi) {
 	vspapi->configPlugin("com.dtlnor.tmcm", "tmcm", "A really simple mask cleaning plugin for VapourSynth based on mt_hysteresis.", VS_MAKE_VERSION(1, 0), VAPOURSYNTH_API_VERSION, 0, plugin);
 	vspapi->registerFunction("TMaskCleanerMod",
 		"clip:vnode;"
 		"length:int:opt;"
 		"thresh:float:opt;"
+		"thresh_low:float:opt;"
+		"thresh_high:float:opt;"
 		"fade:int:opt;"
 		"binarize:int:opt;"
 		"connectivity:int:opt;"
 		"reverse:int:opt;"
-		"mode:int:opt;",
+		"mode:int[]:opt;"
+		"min:int[]:opt;"
+		"max:int[]:opt;"
+		"combine:data:opt;"
+		"target:data:opt;"
+		"engine:int:opt;"
+		"threads:int:opt;"
+		"opt:int:opt;"
+		"left:int:opt;"
+		"top:int:opt;"
+		"width:int:opt;"
+		"height:int:opt;"
+		"outside:data:opt;"
+		"temporal:int:opt;"
+		"profile:int:opt;"
+		"planes:int[]:opt;"
+		"thresh_prop:data:opt;"
+		"length_prop:data:opt;"
+		"fade_prop:data:opt;"
+		"output_format:data:opt;"
+		"packed_mask:int:opt;",
 		"clip:vnode;",
 		TMCCreate, nullptr, plugin);
 
 	vspapi->registerFunction("GetCCLStats",
 		"clip:vnode;"
 		"thresh:float:opt;"
-		"connectivity:int:opt;",
+		"connectivity:int:opt;"
+		"threads:int:opt;"
+		"opt:int:opt;"
+		"stats:data[]:opt;"
+		"packed:int:opt;"
+		"min_area:int:opt;"
+		"max_labels:int:opt;"
+		"left:int:opt;"
+		"top:int:opt;"
+		"width:int:opt;"
+		"height:int:opt;"
+		"planes:int[]:opt;"
+		"thresh_prop:data:opt;",
 		"clip:vnode;",
 		CCLSCreate, nullptr, plugin);
+
+	vspapi->registerFunction("Label",
+		"clip:vnode;"
+		"thresh:float:opt;"
+		"connectivity:int:opt;"
+		"threads:int:opt;"
+		"opt:int:opt;"
+		"bits:int:opt;",
+		"clip:vnode;",
+		LabelCreate, nullptr, plugin);
+
+	vspapi->registerFunction("FilterLabels",
+		"labels:vnode;"
+		"clip:vnode;"
+		"length:int:opt;"
+		"fade:int:opt;"
+		"binarize:int:opt;"
+		"reverse:int:opt;"
+		"mode:int:opt;",
+		"clip:vnode;",
+		FilterLabelsCreate, nullptr, plugin);
+
+	vspapi->registerFunction("Buckets",
+		"clip:vnode;"
+		"lengths:int[];"
+		"thresh:float:opt;"
+		"fade:int:opt;"
+		"binarize:int:opt;"
+		"connectivity:int:opt;"
+		"mode:int:opt;"
+		"threads:int:opt;"
+		"opt:int:opt;",
+		"clip:vnode[];",
+		BucketsCreate, nullptr, plugin);
+
+	vspapi->registerFunction("TMaskCleaner3D",
+		"clip:vnode;"
+		"radius:int:opt;"
+		"length:int:opt;"
+		"thresh:float:opt;"
+		"fade:int:opt;"
+		"binarize:int:opt;"
+		"connectivity:int:opt;"
+		"reverse:int:opt;"
+		"mode:int:opt;"
+		"opt:int:opt;",
+		"clip:vnode;",
+		TMC3DCreate, nullptr, plugin);
 }
@@ -2,74 +2,293 @@
 
 #define NOMINMAX
 #define WIN32_LEAN_AND_MEAN
+#include <map>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include "VapourSynth4.h"
 #include "VSHelper4.h"
+#include "ccl_stream.h"
+#include "tmcm.h"
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
 #include <string>
 #include <numeric>
 #include <algorithm>
+#include <exception>
 
 struct TMCData;
+struct TemporalState;
+struct FrameParams;
+
+// What a process function left in its plane of dst: the written output, or
+// nothing because the output is the source's plane or all zero.
+enum PlaneOutput : int {
+	poWritten,
+	poSource,
+	poZero
+};
 
 typedef std::pair<int, int> Coordinates;
-typedef void (*Process_c_Ptr)(const VSFrame*, VSFrame*, int, const TMCData*, const VSAPI*);
+typedef PlaneOutput (*Process_c_Ptr)(const VSFrame*, VSFrame*, VSMap*, int, int, const TMCData*, const FrameParams&, const VSAPI*);
+typedef bool (*Process_temporal_Ptr)(const VSFrame*, const VSFrame*, VSFrame*, int, const TMCData*, const std::shared_ptr<TemporalState>&, std::shared_ptr<TemporalState>&, const VSAPI*);
 
-struct TMCData {
-	VSNode* node;
-	const VSVideoInfo* vi;
-	unsigned int length;
-	union {
-		uint8_t thresh_u8;
-		uint16_t thresh_u16;
-		float thresh_f32;
-	} thresh_typed;
-	unsigned int fade;
-	Process_c_Ptr process_c_func;
-	const Coordinates* directions;
-	int dir_count;
+union TypedThresh {
+	uint8_t thresh_u8;
+	uint16_t thresh_u16;
+	float thresh_f32;
 
 	template<typename pixel_t>
-	pixel_t get_thresh() const {
+	pixel_t get() const {
 		if constexpr (std::is_same_v<pixel_t, uint8_t>) {
-			return thresh_typed.thresh_u8;
+			return thresh_u8;
 		}
 		else if constexpr (std::is_same_v<pixel_t, uint16_t>) {
-			return thresh_typed.thresh_u16;
+			return thresh_u16;
 		}
 		else {
-			return thresh_typed.thresh_f32;
+			return thresh_f32;
 		}
 	}
 
 	template<typename pixel_t>
-	void set_thresh(pixel_t value) {
+	void set(pixel_t value) {
 		if constexpr (std::is_same_v<pixel_t, uint8_t>) {
-			thresh_typed.thresh_u8 = value;
+			thresh_u8 = value;
 		}
 		else if constexpr (std::is_same_v<pixel_t, uint16_t>) {
-			thresh_typed.thresh_u16 = value;
+			thresh_u16 = value;
 		}
 		else {
-			thresh_typed.thresh_f32 = value;
+			thresh_f32 = value;
 		}
 	}
 };
 
-template<typename pixel_t>
-inline bool is_black(pixel_t value, pixel_t thresh) {
-	return value < thresh;
-}
+// Parameters a frame may override through the props named by thresh_prop,
+// length_prop and fade_prop. They are not template parameters, so the process
+// function chosen at creation serves every frame.
+struct FrameParams {
+	TypedThresh thresh_typed;
+	unsigned int length;
+	unsigned int fade;
 
-inline bool visited(int x, int y, int width, const std::vector<uint8_t>& lookup) {
-	unsigned int normal_pos = y * width + x;
-	return lookup[normal_pos >> 3] & (1 << (normal_pos & 7));
-}
+	template<typename pixel_t>
+	pixel_t get_thresh() const {
+		return thresh_typed.get<pixel_t>();
+	}
+};
 
-inline void visit(int x, int y, int width, std::vector<uint8_t>& lookup) {
-	unsigned int normal_pos = y * width + x;
-	lookup[normal_pos >> 3] |= (1 << (normal_pos & 7));
-}
+// Components TMaskCleanerMod filters: foreground ones that fail the predicate
+// are discarded, background ones (holes) that fail it are filled.
+enum Target : int {
+	tgForeground,
+	tgBackground,
+	tgBoth
+};
+
+// Window of plane 0 that is thresholded and labelled, in frame coordinates.
+// width is 0 when the whole plane is.
+struct Roi {
+	int left;
+	int top;
+	int width;
+	int height;
+};
+
+// Labelling of one output frame, kept for the next one, and that output's
+// plane 0 to share when the next frame's mask is unchanged.
+struct TemporalState {
+	const VSAPI* vsapi;
+	CCLContext ctx;
+	const VSFrame* out = nullptr;
+
+	explicit TemporalState(const VSAPI* vsapi) : vsapi(vsapi) {}
+	~TemporalState() { vsapi->freeFrame(out); }
+};
+
+// States of recently produced frames. Frame n consumes the state of n - 1 and
+// is labelled from scratch when there is none, as happens with out-of-order
+// requests. At most max_cached states are held, lowest frame numbers dropped
+// first. Dropped and superseded states keep their buffers in spare, so a new
+// frame is labelled into one of them rather than into fresh allocations.
+struct TemporalCache {
+	std::mutex lock;
+	std::map<int, std::shared_ptr<TemporalState>> states;
+	std::vector<std::shared_ptr<TemporalState>> spare;
+	size_t max_cached;
+
+	std::shared_ptr<TemporalState> take(int n) {
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = states.find(n);
+		if (it == states.end())
+			return nullptr;
+		auto state = std::move(it->second);
+		states.erase(it);
+		return state;
+	}
+
+	void put(int n, std::shared_ptr<TemporalState> state) {
+		std::vector<std::shared_ptr<TemporalState>> dropped;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			auto& slot = states[n];
+			if (slot)
+				dropped.push_back(std::move(slot));
+			slot = std::move(state);
+			while (states.size() > max_cached) {
+				dropped.push_back(std::move(states.begin()->second));
+				states.erase(states.begin());
+			}
+		}
+		for (auto& old : dropped) {
+			recycle(std::move(old));
+		}
+	}
+
+	// A state to label a frame into, a spare one when there is any.
+	std::shared_ptr<TemporalState> acquire(const VSAPI* vsapi) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (!spare.empty()) {
+				auto state = std::move(spare.back());
+				spare.pop_back();
+				return state;
+			}
+		}
+		return std::make_shared<TemporalState>(vsapi);
+	}
+
+	// Keeps the buffers of a state nothing else refers to, releasing its
+	// output. Shared states are left to their other owners.
+	void recycle(std::shared_ptr<TemporalState> state) {
+		if (!state || state.use_count() > 1)
+			return;
+		state->vsapi->freeFrame(state->out);
+		state->out = nullptr;
+		std::lock_guard<std::mutex> guard(lock);
+		if (spare.size() < max_cached)
+			spare.push_back(std::move(state));
+	}
+};
+
+// Timings and counts of one frame, profile=1.
+struct FrameProfile {
+	double threshold_ms = 0.0;
+	// labelling after thresholding, holes included
+	double label_ms = 0.0;
+	double write_ms = 0.0;
+	int64_t components = 0;
+	int64_t foreground = 0;
+	int64_t largest = 0;
+	int64_t scratch_bytes = 0;
+};
+
+// Per-instance sums of the frame profiles, logged when the filter is freed.
+struct ProfileTotals {
+	std::mutex lock;
+	int64_t frames = 0;
+	double threshold_ms = 0.0;
+	double label_ms = 0.0;
+	double write_ms = 0.0;
+	double max_frame_ms = 0.0;
+	int64_t max_components = 0;
+	int64_t max_largest = 0;
+	int64_t max_scratch_bytes = 0;
+	// frames by component count: 0, 1-9, 10-99, ..., 1000000 and up
+	int64_t components_histogram[8] = {};
+	// frames by total time: under 1 ms, 1-2 ms, 2-4 ms, ..., 512 ms and up
+	int64_t time_histogram[11] = {};
+
+	void add(const FrameProfile& p);
+	std::string summary() const;
+};
+
+// Format of TMaskCleanerMod's output: the input's, or a single 8-bit plane.
+enum OutputFormat : int {
+	ofSame,
+	ofGray8
+};
+
+// Frame with every plane zero, made on first use and shared by the outputs
+// whose components are all discarded.
+struct ZeroFrame {
+	std::mutex lock;
+	const VSFrame* frame = nullptr;
+};
+
+struct TMCData {
+	VSNode* node;
+	const VSVideoInfo* vi;
+	unsigned int length;
+	TypedThresh thresh_typed;
+	// with hysteresis, components grown over thresh are kept only if one of
+	// their pixels reaches thresh_high
+	TypedThresh thresh_high_typed;
+	bool hysteresis;
+	int target;
+	unsigned int fade;
+	Process_c_Ptr process_c_func;
+	const Coordinates* directions;
+	int dir_count;
+	int threads;
+	// workers for threads > 1 and for several planes, see createPool()
+	std::unique_ptr<WorkerPool> pool;
+	// hot loops for the CPU, or the level forced by `opt`
+	const Kernels* kernels = &kernels_scalar;
+	Roi roi;
+	// pixels outside roi are copied from the source instead of zeroed
+	bool roi_copy;
+	// temporal=1: the previous frame's labelling, relabelled where it changed
+	std::unique_ptr<TemporalCache> temporal;
+	Process_temporal_Ptr process_temporal_func;
+	// profile=1: per-frame props and the totals logged by FilterFree()
+	std::unique_ptr<ProfileTotals> profile;
+	// planes processed, concurrently when there are several
+	std::vector<int> planes;
+	ZeroFrame zero;
+	int output_format;
+	// packed_mask=1: the kept pixels as a bitmap prop, see pack_kept()
+	bool packed_mask;
+	// names of the props overriding thresh, length and fade, empty for none
+	std::string thresh_prop;
+	std::string length_prop;
+	std::string fade_prop;
+	VSVideoInfo out_vi;
+	std::vector<Constraint> constraints;
+	bool constraints_any;
+	unsigned intensity_stats;
+	bool packed_stats;
+	int64_t min_area;
+	int max_labels;
+
+	template<typename pixel_t>
+	pixel_t get_thresh() const {
+		return thresh_typed.get<pixel_t>();
+	}
+
+	template<typename pixel_t>
+	void set_thresh(pixel_t value) {
+		thresh_typed.set<pixel_t>(value);
+	}
+
+	// the parameters of a frame without overriding props
+	FrameParams frame_params() const {
+		return FrameParams{ thresh_typed, length, fade };
+	}
+
+	template<typename pixel_t>
+	pixel_t get_thresh_high() const {
+		return thresh_high_typed.get<pixel_t>();
+	}
+
+	template<typename pixel_t>
+	void set_thresh_high(pixel_t value) {
+		thresh_high_typed.set<pixel_t>(value);
+	}
+};
 
 constexpr Coordinates directions4[4] = { {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
 constexpr Coordinates directions8[8] = {
@@ -78,22 +297,168 @@ constexpr Coordinates directions8[8] = {
 	{-1, 1},  {0, 1},  {1, 1}
 };
 
+// profile instantiations time and count each frame, the others carry no trace of it
+template<int filter_mode, bool binarize, bool reverse, typename pixel_t, bool profile = false>
+PlaneOutput process_c(const VSFrame* src, VSFrame* dst, VSMap* props, int plane, int bits, const TMCData* d, const FrameParams& fp, const VSAPI* vsapi);
+
+template<int filter_mode, bool binarize, bool reverse, typename pixel_t>
+PlaneOutput process_c_floodfill(const VSFrame* src, VSFrame* dst, VSMap* props, int plane, int bits, const TMCData* d, const FrameParams& fp, const VSAPI* vsapi);
+
+template<bool binarize, bool reverse, typename pixel_t>
+PlaneOutput process_c_constraints(const VSFrame* src, VSFrame* dst, VSMap* props, int plane, int bits, const TMCData* d, const FrameParams& fp, const VSAPI* vsapi);
+
+template<int filter_mode, bool binarize, bool reverse, typename pixel_t>
+PlaneOutput process_c_gray8(const VSFrame* src, VSFrame* dst, VSMap* props, int plane, int bits, const TMCData* d, const FrameParams& fp, const VSAPI* vsapi);
+
+template<int filter_mode, bool binarize, bool reverse, typename pixel_t>
+bool process_c_temporal(const VSFrame* src, const VSFrame* prev_src, VSFrame* dst, int bits, const TMCData* d, const std::shared_ptr<TemporalState>& prev, std::shared_ptr<TemporalState>& next, const VSAPI* vsapi);
+
+// engine 0: run-length union-find labeller, engine 1: legacy flood fill
+template<int filter_mode, bool binarize, bool reverse, typename pixel_t>
+Process_c_Ptr selectEngine(int engine, bool profile, bool gray8) {
+	if (engine == 1)
+		return &process_c_floodfill<filter_mode, binarize, reverse, pixel_t>;
+	if (gray8)
+		return &process_c_gray8<filter_mode, binarize, reverse, pixel_t>;
+	if (profile)
+		return &process_c<filter_mode, binarize, reverse, pixel_t, true>;
+	return &process_c<filter_mode, binarize, reverse, pixel_t>;
+}
+
 template<bool binarize, bool reverse, typename pixel_t>
-void setProcessFunction(TMCData* d, int mode) {
+void setProcessFunction(TMCData* d, int mode, int engine) {
+	if (!d->constraints.empty()) {
+		d->process_c_func = &process_c_constraints<binarize, reverse, pixel_t>;
+		return;
+	}
+
+	if (d->temporal) {
+		switch (mode) {
+		case 0: d->process_temporal_func = &process_c_temporal<0, binarize, reverse, pixel_t>; break;
+		case 1: d->process_temporal_func = &process_c_temporal<1, binarize, reverse, pixel_t>; break;
+		case 2: d->process_temporal_func = &process_c_temporal<2, binarize, reverse, pixel_t>; break;
+		case 3: d->process_temporal_func = &process_c_temporal<3, binarize, reverse, pixel_t>; break;
+		case 4: d->process_temporal_func = &process_c_temporal<4, binarize, reverse, pixel_t>; break;
+		case 5: d->process_temporal_func = &process_c_temporal<5, binarize, reverse, pixel_t>; break;
+		case 6: d->process_temporal_func = &process_c_temporal<6, binarize, reverse, pixel_t>; break;
+		case 7: d->process_temporal_func = &process_c_temporal<7, binarize, reverse, pixel_t>; break;
+		case 8: d->process_temporal_func = &process_c_temporal<8, binarize, reverse, pixel_t>; break;
+		default: throw std::string("mode must be in the range [0, 8].");
+		}
+	}
+
 	switch (mode) {
-	case 0: d->process_c_func = &process_c<0, binarize, reverse, pixel_t>; break;
-	case 1: d->process_c_func = &process_c<1, binarize, reverse, pixel_t>; break;
-	case 2: d->process_c_func = &process_c<2, binarize, reverse, pixel_t>; break;
-	case 3: d->process_c_func = &process_c<3, binarize, reverse, pixel_t>; break;
-	case 4: d->process_c_func = &process_c<4, binarize, reverse, pixel_t>; break;
-	case 5: d->process_c_func = &process_c<5, binarize, reverse, pixel_t>; break;
-	case 6: d->process_c_func = &process_c<6, binarize, reverse, pixel_t>; break;
-	case 7: d->process_c_func = &process_c<7, binarize, reverse, pixel_t>; break;
-	case 8: d->process_c_func = &process_c<8, binarize, reverse, pixel_t>; break;
+	case 0: d->process_c_func = selectEngine<0, binarize, reverse, pixel_t>(engine, d->profile != nullptr, d->output_format == ofGray8); break;
+	case 1: d->process_c_func = selectEngine<1, binarize, reverse, pixel_t>(engine, d->profile != nullptr, d->output_format == ofGray8); break;
+	case 2: d->process_c_func = selectEngine<2, binarize, reverse, pixel_t>(engine, d->profile != nullptr, d->output_format == ofGray8); break;
+	case 3: d->process_c_func = selectEngine<3, binarize, reverse, pixel_t>(engine, d->profile != nullptr, d->output_format == ofGray8); break;
+	case 4: d->process_c_func = selectEngine<4, binarize, reverse, pixel_t>(engine, d->profile != nullptr, d->output_format == ofGray8); break;
+	case 5: d->process_c_func = selectEngine<5, binarize, reverse, pixel_t>(engine, d->profile != nullptr, d->output_format == ofGray8); break;
+	case 6: d->process_c_func = selectEngine<6, binarize, reverse, pixel_t>(engine, d->profile != nullptr, d->output_format == ofGray8); break;
+	case 7: d->process_c_func = selectEngine<7, binarize, reverse, pixel_t>(engine, d->profile != nullptr, d->output_format == ofGray8); break;
+	case 8: d->process_c_func = selectEngine<8, binarize, reverse, pixel_t>(engine, d->profile != nullptr, d->output_format == ofGray8); break;
 	default: throw std::string("mode must be in the range [0, 8].");
 	}
 }
 
+// Output of a foreground-only plane that can skip the write-back: poZero when
+// every component is discarded, poSource when every one is kept whole and the
+// source already holds what would be written (zero below thresh, and peak at or
+// above it with binarize), poWritten otherwise.
+template<bool binarize, typename pixel_t>
+inline PlaneOutput unwritten_output(const pixel_t* srcptr, int stride, int width, int height, int bits, pixel_t thresh, const double* fade_factors, size_t num_components) {
+	bool all_discarded = true, all_kept = true;
+	for (size_t label = 0; label < num_components; ++label) {
+		all_discarded &= fade_factors[label] < 0.0;
+		all_kept &= fade_factors[label] == 1.0;
+	}
+	if (all_discarded)
+		return poZero;
+	if (!all_kept)
+		return poWritten;
+
+	const pixel_t peak = static_cast<pixel_t>((sizeof(pixel_t) != 4) ? (1 << bits) - 1 : 1.0f);
+	for (int y = 0; y < height; ++y) {
+		const pixel_t* s = srcptr + stride * y;
+		bool same = true;
+		for (int x = 0; x < width; ++x) {
+			if constexpr (binarize)
+				same &= s[x] >= thresh ? s[x] == peak : s[x] == 0;
+			else
+				same &= s[x] >= thresh || s[x] == 0;
+		}
+		if (!same)
+			return poWritten;
+	}
+	return poSource;
+}
+
+// Writes the part of a width x height plane outside roi: the source with copy,
+// zero otherwise.
+template<typename pixel_t>
+inline void write_outside_roi(const pixel_t* srcptr, pixel_t* VS_RESTRICT dstptr, int stride, int width, int height, const Roi& roi, bool copy) {
+	auto write = [&](int y, int x0, int x1) {
+		if (x0 >= x1) return;
+		if (copy)
+			memcpy(dstptr + stride * y + x0, srcptr + stride * y + x0, (x1 - x0) * sizeof(pixel_t));
+		else
+			memset(dstptr + stride * y + x0, 0, (x1 - x0) * sizeof(pixel_t));
+	};
+	for (int y = 0; y < height; ++y) {
+		if (y < roi.top || y >= roi.top + roi.height) {
+			write(y, 0, width);
+		}
+		else {
+			write(y, 0, roi.left);
+			write(y, roi.left + roi.width, width);
+		}
+	}
+}
+
+extern Roi getRoi(const VSMap* in, const VSVideoInfo* vi, const VSAPI* vsapi);
+extern std::vector<int> getPlanes(const VSMap* in, const VSVideoInfo* vi, const Roi& roi, const VSAPI* vsapi);
+// Runs d->process_c_func on each of d->planes, one thread per plane. outputs,
+// indexed by plane, receives what each one left in dst.
+extern void process_planes(const VSFrame* src, VSFrame* dst, int bits, const TMCData* d, const FrameParams& fp, const VSAPI* vsapi, PlaneOutput* outputs = nullptr);
+extern void getPropNames(const VSMap* in, TMCData* d, const VSAPI* vsapi);
+// Starts the workers of d->threads and d->planes, none when one thread is enough.
+extern void createPool(TMCData* d);
+// d's parameters, overridden by those of src's props named by d
+extern FrameParams getFrameParams(const VSFrame* src, const TMCData* d, const VSAPI* vsapi);
+
+// Key of a per-plane prop: plane 0 keeps name, the others get a "_P<plane>"
+// suffix.
+inline std::string plane_key(const char* name, int plane) {
+	return plane == 0 ? std::string(name) : std::string(name) + "_P" + std::to_string(plane);
+}
+
 extern void VS_CC FilterFree(void* instanceData, VSCore* core, const VSAPI* vsapi);
 extern void VS_CC TMCCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core, const VSAPI* vsapi);
 extern void VS_CC CCLSCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core, const VSAPI* vsapi);
+extern void VS_CC LabelCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core, const VSAPI* vsapi);
+extern void VS_CC FilterLabelsCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core, const VSAPI* vsapi);
+extern void VS_CC BucketsCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core, const VSAPI* vsapi);
+extern void VS_CC TMC3DCreate(const VSMap* in, VSMap* out, void* userData, VSCore* core, const VSAPI* vsapi);
+
+// Which components the stats props cover and where they go. Without kept every
+// component is emitted; with packed the columns are appended to the blob
+// instead of being set as props. Stats measured in an ROI window are moved by
+// its origin (left, top).
+struct StatsOutput {
+	const uint32_t* kept = nullptr;
+	size_t num_kept = 0;
+	std::vector<uint8_t>* packed = nullptr;
+	// plane the props are keyed for, see plane_key()
+	int plane = 0;
+	int left = 0;
+	int top = 0;
+
+	// number of emitted labels, the background included
+	size_t labels(size_t num_components) const { return (kept ? num_kept : num_components) + 1; }
+	// component behind emitted label > 0
+	size_t component(size_t label) const { return kept ? kept[label - 1] : label - 1; }
+};
+
+extern void setProfileProps(const FrameProfile& p, int plane, VSMap* props, const VSAPI* vsapi);
+extern void setPackedMask(const CCLScratch& scratch, const double* fade_factors, int width, int height, const Roi& roi, int plane, VSMap* props, const VSAPI* vsapi);
+extern void setCCLStatsProps(const ComponentStats* stats, size_t num_components, const ComponentStats& background, const StatsOutput& out, VSMap* props, const VSAPI* vsapi);
@@ -0,0 +1,128 @@
+#include "tmcm.h"
+
+template<bool reverse>
+static void filter_mode(CCLContext& ctx, int mode, unsigned int length, unsigned int fade) {
+	const ComponentStats* stats = ctx.stats();
+	switch (mode) {
+	case 0: filter_components<0, reverse>(stats, ctx.num_components, length, fade, ctx.fade_factors); break;
+	case 1: filter_components<1, reverse>(stats, ctx.num_components, length, fade, ctx.fade_factors); break;
+	case 2: filter_components<2, reverse>(stats, ctx.num_components, length, fade, ctx.fade_factors); break;
+	case 3: filter_components<3, reverse>(stats, ctx.num_components, length, fade, ctx.fade_factors); break;
+	case 4: filter_components<4, reverse>(stats, ctx.num_components, length, fade, ctx.fade_factors); break;
+	case 5: filter_components<5, reverse>(stats, ctx.num_components, length, fade, ctx.fade_factors); break;
+	case 6: filter_components<6, reverse>(stats, ctx.num_components, length, fade, ctx.fade_factors); break;
+	case 7: filter_components<7, reverse>(stats, ctx.num_components, length, fade, ctx.fade_factors); break;
+	case 8: filter_components<8, reverse>(stats, ctx.num_components, length, fade, ctx.fade_factors); break;
+	default: throw std::invalid_argument("mode must be in the range [0, 8].");
+	}
+}
+
+// Background stats from the totals of every component and the background box.
+static ComponentStats background_stats(const ComponentStats* stats, size_t num_components, const BackgroundBox& box, int width, int height) {
+	int64_t fg_area = 0, fg_sum_x = 0, fg_sum_y = 0;
+	for (size_t label = 0; label < num_components; ++label) {
+		fg_area += stats[label].area;
+		fg_sum_x += stats[label].sum_x;
+		fg_sum_y += stats[label].sum_y;
+	}
+
+	ComponentStats bg;
+	bg.area = static_cast<int64_t>(width) * height - fg_area;
+	bg.sum_x = static_cast<int64_t>(width) * (width - 1) / 2 * height - fg_sum_x;
+	bg.sum_y = static_cast<int64_t>(height) * (height - 1) / 2 * width - fg_sum_y;
+	box.columns(width, bg.min_x, bg.max_x);
+	bg.min_y = box.min_y;
+	bg.max_y = box.max_y;
+	if (bg.area == 0) {
+		bg.min_x = 0;
+		bg.min_y = 0;
+	}
+	return bg;
+}
+
+template<typename pixel_t>
+size_t ccl_label(CCLContext& ctx, const pixel_t* srcptr, ptrdiff_t stride, int width, int height, pixel_t thresh, bool eight_connected, int threads, double* threshold_ms) {
+	if (threshold_ms)
+		ctx.num_components = label_plane<pixel_t, true>(*ctx.kernels, srcptr, stride, width, height, thresh, eight_connected, threads, ctx.pool, ctx.scratch, threshold_ms);
+	else
+		ctx.num_components = label_plane<pixel_t>(*ctx.kernels, srcptr, stride, width, height, thresh, eight_connected, threads, ctx.pool, ctx.scratch);
+	ctx.streamed = false;
+	return ctx.num_components;
+}
+
+void ccl_background(CCLContext& ctx, int width, int height) {
+	const CCLScratch& scratch = ctx.scratch;
+	const Bitmap& bitmap = scratch.bitmap;
+	ctx.box.reset(bitmap.words, height);
+	for (int y = 0; y < height; ++y) {
+		int64_t row_area = 0;
+		for (uint32_t i = scratch.row_start[y]; i < scratch.row_start[y + 1]; ++i) {
+			row_area += scratch.runs[i].x1 - scratch.runs[i].x0 + 1;
+		}
+		ctx.box.add_row(*ctx.kernels, y, bitmap.row(y), bitmap.spans[y], row_area == width);
+	}
+	ctx.background = background_stats(scratch.stats.data(), ctx.num_components, ctx.box, width, height);
+}
+
+template<typename pixel_t>
+size_t ccl_stats(CCLContext& ctx, const pixel_t* srcptr, ptrdiff_t stride, int width, int height, pixel_t thresh, bool eight_connected, int threads, unsigned intensity_stats) {
+	/* strips need the whole plane's runs, a single thread streams rows */
+	if (threads > 1) {
+		ccl_label<pixel_t>(ctx, srcptr, stride, width, height, thresh, eight_connected, threads);
+		ccl_background(ctx, width, height);
+
+		ctx.background_intensity = empty_intensity;
+		if (intensity_stats) {
+			const CCLScratch& scratch = ctx.scratch;
+			ctx.intensity.assign(ctx.num_components, empty_intensity);
+			for (int y = 0; y < height; ++y) {
+				const uint32_t first = scratch.row_start[y];
+				ctx.kernels->pixel<pixel_t>().measure_row(srcptr + stride * y, width, y, scratch.runs.data() + first, scratch.parent.data() + first, scratch.row_start[y + 1] - first, intensity_stats, ctx.intensity.data(), ctx.background_intensity);
+			}
+		}
+	}
+	else {
+		ctx.num_components = stream_plane<pixel_t>(*ctx.kernels, srcptr, stride, width, height, thresh, eight_connected, intensity_stats, ctx.stream);
+		ctx.streamed = true;
+		ctx.background = background_stats(ctx.stream.stats.data(), ctx.num_components, ctx.stream.background, width, height);
+		ctx.background_intensity = ctx.stream.background_intensity;
+	}
+	return ctx.num_components;
+}
+
+void ccl_filter(CCLContext& ctx, int mode, unsigned int length, unsigned int fade, bool reverse) {
+	if (reverse)
+		filter_mode<true>(ctx, mode, length, fade);
+	else
+		filter_mode<false>(ctx, mode, length, fade);
+}
+
+template<typename pixel_t>
+void ccl_write(const CCLContext& ctx, const pixel_t* srcptr, pixel_t* dstptr, ptrdiff_t stride, int width, int bits, bool binarize) {
+	if (binarize)
+		write_components<true, pixel_t>(*ctx.kernels, srcptr, dstptr, stride, width, bits, ctx.scratch, ctx.fade_factors.data(), ctx.pool);
+	else
+		write_components<false, pixel_t>(*ctx.kernels, srcptr, dstptr, stride, width, bits, ctx.scratch, ctx.fade_factors.data(), ctx.pool);
+}
+
+template<typename pixel_t>
+size_t ccl_clean(CCLContext& ctx, const pixel_t* srcptr, pixel_t* dstptr, ptrdiff_t stride, int width, int height, int bits, pixel_t thresh, const CleanParams& p) {
+	const size_t num_components = ccl_label<pixel_t>(ctx, srcptr, stride, width, height, thresh, p.eight_connected, p.threads);
+	ccl_filter(ctx, p.mode, p.length, p.fade, p.reverse);
+	ccl_write<pixel_t>(ctx, srcptr, dstptr, stride, width, bits, p.binarize);
+	ctx.trim();
+	return num_components;
+}
+
+template size_t ccl_label<uint8_t>(CCLContext&, const uint8_t*, ptrdiff_t, int, int, uint8_t, bool, int, double*);
+template size_t ccl_label<uint16_t>(CCLContext&, const uint16_t*, ptrdiff_t, int, int, uint16_t, bool, int, double*);
+template size_t ccl_label<float>(CCLContext&, const float*, ptrdiff_t, int, int, float, bool, int, double*);
+template size_t ccl_stats<uint8_t>(CCLContext&, const uint8_t*, ptrdiff_t, int, int, uint8_t, bool, int, unsigned);
+template size_t ccl_stats<uint16_t>(CCLContext&, const uint16_t*, ptrdiff_t, int, int, uint16_t, bool, int, unsigned);
+template size_t ccl_stats<float>(CCLContext&, const float*, ptrdiff_t, int, int, float, bool, int, unsigned);
+template void ccl_write<uint8_t>(const CCLContext&, const uint8_t*, uint8_t*, ptrdiff_t, int, int, bool);
+template void ccl_write<uint16_t>(const CCLContext&, const uint16_t*, uint16_t*, ptrdiff_t, int, int, bool);
+template void ccl_write<float>(const CCLContext&, const float*, float*, ptrdiff_t, int, int, bool);
+template size_t ccl_clean<uint8_t>(CCLContext&, const uint8_t*, uint8_t*, ptrdiff_t, int, int, int, uint8_t, const CleanParams&);
+template size_t ccl_clean<uint16_t>(CCLContext&, const uint16_t*, uint16_t*, ptrdiff_t, int, int, int, uint16_t, const CleanParams&);
+template size_t ccl_clean<float>(CCLContext&, const float*, float*, ptrdiff_t, int, int, int, float, const CleanParams&);
@@ -0,0 +1,188 @@
+#pragma once
+
+// Raw-buffer front of the labeller, built as the tmcm static library and used
+// by the plugin. Planes are pointers with strides in pixels, 8-16 bit integer
+// or float, and nothing here knows about VapourSynth frames.
+
+#include <stdexcept>
+#include "ccl_stream.h"
+
+#if defined(_MSC_VER)
+#define TMCM_RESTRICT __restrict
+#else
+#define TMCM_RESTRICT __restrict__
+#endif
+
+// Labelling state reused plane after plane by one thread: the kernels picked
+// by select_kernels(), the runs and stats of the last plane labelled or
+// streamed, the fade factors of its components and its background.
+struct CCLContext {
+	const Kernels* kernels = &kernels_scalar;
+	// not owned, strips start their own threads per call without one
+	WorkerPool* pool = nullptr;
+	CCLScratch scratch;
+	CCLStream stream;
+	// the last plane went through stream rather than scratch, see ccl_stats()
+	bool streamed = false;
+	size_t num_components = 0;
+	std::vector<double> fade_factors;
+	BackgroundBox box;
+	ComponentStats background{};
+	std::vector<IntensityStats> intensity;
+	IntensityStats background_intensity = empty_intensity;
+
+	// stats of components 0 .. num_components - 1
+	const ComponentStats* stats() const { return streamed ? stream.stats.data() : scratch.stats.data(); }
+	// their intensity, when ccl_stats() was asked for some
+	const IntensityStats* intensity_stats() const { return streamed ? stream.intensity.data() : intensity.data(); }
+
+	void trim() {
+		scratch.trim();
+		stream.trim();
+		trim_capacity(fade_factors, fade_factors.size());
+		trim_capacity(intensity, intensity.size());
+	}
+};
+
+// What TMaskCleanerMod does to a whole plane with the foreground target:
+// components whose mode value is below length (above it with reverse) are
+// discarded, those within fade of it are faded.
+struct CleanParams {
+	int mode = 0;
+	unsigned int length = 5;
+	unsigned int fade = 0;
+	bool reverse = false;
+	bool binarize = false;
+	bool eight_connected = true;
+	int threads = 1;
+};
+
+// Fade factors of count components, negative for discarded ones.
+template<int filter_mode, bool reverse>
+inline void filter_components(const ComponentStats* stats, size_t count, unsigned int length, unsigned int fade, std::vector<double>& factors) {
+	const double fade_inv = fade > 0 ? 1.0f / fade : 0.0f;
+	factors.resize(count);
+	for (size_t label = 0; label < count; ++label) {
+		factors[label] = component_factor<reverse>(component_value<filter_mode>(stats[label]), length, fade, fade_inv);
+	}
+}
+
+// Clears the width x height window at dstptr and writes every run whose
+// component has a non-negative fade factor, one strip per worker.
+template<bool binarize, typename pixel_t>
+inline void write_components(const Kernels& k, const pixel_t* srcptr, pixel_t* TMCM_RESTRICT dstptr, ptrdiff_t stride, int width, int bits, const CCLScratch& scratch, const double* fade_factors, WorkerPool* pool) {
+	const auto peak = (sizeof(pixel_t) != 4) ? (1 << bits) - 1 : 1.0f;
+	const auto write_runs = k.pixel<pixel_t>().write_runs[binarize];
+
+	parallel_for(pool, static_cast<int>(scratch.strip_y.size()) - 1, [&](int strip) {
+		const int y0 = scratch.strip_y[strip], y1 = scratch.strip_y[strip + 1];
+		for (int y = y0; y < y1; ++y) {
+			memset(dstptr + stride * y, 0, width * sizeof(pixel_t));
+		}
+
+		const uint32_t first = scratch.row_start[y0];
+		write_runs(srcptr, dstptr, stride, peak, scratch.runs.data() + first, scratch.parent.data() + first, scratch.row_start[y1] - first, fade_factors);
+	});
+}
+
+// Source value scaled to 8 bits.
+template<typename pixel_t>
+inline unsigned int to_gray8(pixel_t value, int bits) {
+	if constexpr (std::is_same_v<pixel_t, uint8_t>)
+		return value;
+	else if constexpr (std::is_same_v<pixel_t, uint16_t>)
+		return value >> (bits - 8);
+	else
+		return static_cast<unsigned int>(std::clamp(value, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+// write_components into an 8-bit plane. levels holds each component's fade
+// factor as 0-255, kept runs get their level or, without binarize, the source
+// scaled to 8 bits times level / 255, all in integer arithmetic.
+template<bool binarize, typename pixel_t>
+inline void write_components_gray8(const pixel_t* srcptr, uint8_t* TMCM_RESTRICT dstptr, int srcStride, int dstStride, int width, int bits, const CCLScratch& scratch, const double* fade_factors, const uint8_t* levels, WorkerPool* pool) {
+	parallel_for(pool, static_cast<int>(scratch.strip_y.size()) - 1, [&](int strip) {
+		const int y0 = scratch.strip_y[strip], y1 = scratch.strip_y[strip + 1];
+		for (int y = y0; y < y1; ++y) {
+			memset(dstptr + dstStride * y, 0, width);
+		}
+
+		for (uint32_t i = scratch.row_start[y0]; i < scratch.row_start[y1]; ++i) {
+			const Run& run = scratch.runs[i];
+			const uint32_t id = scratch.parent[i];
+			if (fade_factors[id] < 0.0)
+				continue;
+			uint8_t* dd = dstptr + dstStride * run.y;
+			if constexpr (binarize) {
+				memset(dd + run.x0, levels[id], run.x1 - run.x0 + 1);
+			}
+			else {
+				const pixel_t* s = srcptr + srcStride * run.y;
+				const unsigned int level = levels[id];
+				for (int x = run.x0; x <= run.x1; ++x) {
+					dd[x] = static_cast<uint8_t>((to_gray8(s[x], bits) * level + 127) / 255);
+				}
+			}
+		}
+	});
+}
+
+// Sets bits x0 to x1 of a packed row.
+inline void set_bits(uint8_t* row, int x0, int x1) {
+	const int b0 = x0 >> 3, b1 = x1 >> 3;
+	const uint8_t first = static_cast<uint8_t>(0xFF << (x0 & 7));
+	const uint8_t last = static_cast<uint8_t>(0xFF >> (7 - (x1 & 7)));
+	if (b0 == b1) {
+		row[b0] |= first & last;
+		return;
+	}
+	row[b0] |= first;
+	memset(row + b0 + 1, 0xFF, b1 - b0 - 1);
+	row[b1] |= last;
+}
+
+// Bitmap of the pixels of the components kept with a non-negative factor,
+// width x height with the runs moved by (left, top): rows of (width + 7) / 8
+// bytes, pixel x in bit x % 8 of byte x / 8.
+inline void pack_kept(const CCLScratch& scratch, const double* fade_factors, int width, int height, int left, int top, std::vector<uint8_t>& packed) {
+	const size_t row_bytes = (static_cast<size_t>(width) + 7) / 8;
+	packed.assign(row_bytes * height, 0);
+	for (size_t i = 0; i < scratch.runs.size(); ++i) {
+		const Run& run = scratch.runs[i];
+		if (fade_factors[scratch.parent[i]] >= 0.0)
+			set_bits(packed.data() + row_bytes * (run.y + top), run.x0 + left, run.x1 + left);
+	}
+}
+
+// Thresholds and labels a width x height plane into ctx, see label_plane().
+// Returns the number of components. threshold_ms, when given, receives the
+// time spent thresholding.
+template<typename pixel_t>
+size_t ccl_label(CCLContext& ctx, const pixel_t* srcptr, ptrdiff_t stride, int width, int height, pixel_t thresh, bool eight_connected, int threads, double* threshold_ms = nullptr);
+
+// Sets ctx.background from the plane labelled last by ccl_label(): what is
+// left of the width x height plane by its components, with their box.
+void ccl_background(CCLContext& ctx, int width, int height);
+
+// What GetCCLStats reports of a plane: labels it like ccl_label() and sets
+// ctx.background, and for each IntensityStat bit in intensity_stats the
+// intensity of every component and of the background. A single thread streams
+// the rows instead, leaving no runs in ctx to write back. Returns the number
+// of components.
+template<typename pixel_t>
+size_t ccl_stats(CCLContext& ctx, const pixel_t* srcptr, ptrdiff_t stride, int width, int height, pixel_t thresh, bool eight_connected, int threads, unsigned intensity_stats);
+
+// Sets ctx.fade_factors from the stats of the last plane labelled. Throws
+// std::invalid_argument when mode is not in [0, 8].
+void ccl_filter(CCLContext& ctx, int mode, unsigned int length, unsigned int fade, bool reverse);
+
+// Writes the labelled plane to dstptr, which has the source's stride: kept
+// components scaled by their factor (peak times it with binarize), zero
+// elsewhere. bits is that of integer samples and ignored for float.
+template<typename pixel_t>
+void ccl_write(const CCLContext& ctx, const pixel_t* srcptr, pixel_t* dstptr, ptrdiff_t stride, int width, int bits, bool binarize);
+
+// ccl_label, ccl_filter and ccl_write in one call. Returns the number of
+// components before filtering.
+template<typename pixel_t>
+size_t ccl_clean(CCLContext& ctx, const pixel_t* srcptr, pixel_t* dstptr, ptrdiff_t stride, int width, int height, int bits, pixel_t thresh, const CleanParams& p);
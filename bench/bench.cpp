@@ -0,0 +1,676 @@
+// Standalone kernel benchmark. Runs every process_c instantiation selected by
+// setProcessFunction and every process_ccls instantiation over synthetic masks,
+// using an in-process stand-in for the few VSAPI calls the kernels make.
+// Peak memory is the heap high-water mark of the case, scratch buffers included.
+//
+// --check instead compares the outputs of engine 0, engine 1 and the library's
+// ccl_clean with a frozen copy of the baseline process_c, and ccl_stats with
+// the props of process_ccls, and fails on any difference.
+//
+// usage: tmcm_bench [--size WxH] [--iters N] [--threads N] [--opt N] [--filter substring] [--check]
+
+#include "TMaskCleanerMod.cpp"
+#include "GetCCLStats.cpp"
+#include "Label.cpp"
+#include "Buckets.cpp"
+#include "TMaskCleaner3D.cpp"
+#include "shared.cpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <new>
+#include <random>
+
+/* heap accounting for peak memory per case */
+static std::atomic<size_t> heap_current{ 0 };
+static std::atomic<size_t> heap_peak{ 0 };
+
+static void* counted_alloc(size_t size) {
+	void* p = std::malloc(size + sizeof(std::max_align_t));
+	if (!p)
+		throw std::bad_alloc();
+	*static_cast<size_t*>(p) = size;
+	const size_t now = heap_current.fetch_add(size) + size;
+	size_t peak = heap_peak.load();
+	while (now > peak && !heap_peak.compare_exchange_weak(peak, now)) {}
+	return static_cast<char*>(p) + sizeof(std::max_align_t);
+}
+
+static void counted_free(void* p) {
+	if (!p)
+		return;
+	char* base = static_cast<char*>(p) - sizeof(std::max_align_t);
+	heap_current.fetch_sub(*reinterpret_cast<size_t*>(base));
+	std::free(base);
+}
+
+void* operator new(size_t size) { return counted_alloc(size); }
+void* operator new[](size_t size) { return counted_alloc(size); }
+void operator delete(void* p) noexcept { counted_free(p); }
+void operator delete[](void* p) noexcept { counted_free(p); }
+void operator delete(void* p, size_t) noexcept { counted_free(p); }
+void operator delete[](void* p, size_t) noexcept { counted_free(p); }
+
+/* stub frames, maps and the VSAPI subset used by the kernels */
+struct VSMap {
+	std::map<std::string, std::vector<int64_t>> ints;
+	std::map<std::string, std::vector<double>> floats;
+	std::map<std::string, std::string> data;
+};
+
+struct VSFrame {
+	int width;
+	int height;
+	ptrdiff_t stride;
+	std::vector<uint8_t> plane;
+	VSMap props;
+};
+
+static const uint8_t* VS_CC stubGetReadPtr(const VSFrame* f, int) { return f->plane.data(); }
+static uint8_t* VS_CC stubGetWritePtr(VSFrame* f, int) { return f->plane.data(); }
+static ptrdiff_t VS_CC stubGetStride(const VSFrame* f, int) { return f->stride; }
+static int VS_CC stubGetFrameWidth(const VSFrame* f, int) { return f->width; }
+static int VS_CC stubGetFrameHeight(const VSFrame* f, int) { return f->height; }
+static VSMap* VS_CC stubGetFramePropertiesRW(VSFrame* f) { return &f->props; }
+
+static int VS_CC stubMapSetInt(VSMap* map, const char* key, int64_t i, int append) {
+	auto& v = map->ints[key];
+	if (append == maReplace)
+		v.clear();
+	v.push_back(i);
+	return 0;
+}
+
+static int VS_CC stubMapSetIntArray(VSMap* map, const char* key, const int64_t* i, int size) {
+	map->ints[key].assign(i, i + size);
+	return 0;
+}
+
+static int VS_CC stubMapSetFloat(VSMap* map, const char* key, double d, int append) {
+	auto& v = map->floats[key];
+	if (append == maReplace)
+		v.clear();
+	v.push_back(d);
+	return 0;
+}
+
+static int VS_CC stubMapSetFloatArray(VSMap* map, const char* key, const double* d, int size) {
+	map->floats[key].assign(d, d + size);
+	return 0;
+}
+
+static int VS_CC stubMapSetData(VSMap* map, const char* key, const char* data, int size, int type, int append) {
+	map->data[key].assign(data, size < 0 ? strlen(data) : size);
+	return 0;
+}
+
+static VSAPI makeStubApi() {
+	VSAPI api{};
+	api.getReadPtr = stubGetReadPtr;
+	api.getWritePtr = stubGetWritePtr;
+	api.getStride = stubGetStride;
+	api.getFrameWidth = stubGetFrameWidth;
+	api.getFrameHeight = stubGetFrameHeight;
+	api.getFramePropertiesRW = stubGetFramePropertiesRW;
+	api.mapSetInt = stubMapSetInt;
+	api.mapSetIntArray = stubMapSetIntArray;
+	api.mapSetFloat = stubMapSetFloat;
+	api.mapSetFloatArray = stubMapSetFloatArray;
+	api.mapSetData = stubMapSetData;
+	return api;
+}
+
+template<typename pixel_t>
+static VSFrame makeFrame(int width, int height) {
+	VSFrame f;
+	f.width = width;
+	f.height = height;
+	f.stride = (width * sizeof(pixel_t) + 63) & ~ptrdiff_t(63);
+	f.plane.assign(f.stride * height, 0);
+	return f;
+}
+
+/* synthetic masks, fg marks pixels at or above thresh */
+struct Pattern {
+	const char* name;
+	std::function<bool(int x, int y, int width, int height, std::mt19937& rng)> fg;
+};
+
+static const Pattern patterns[] = {
+	{ "sparse", [](int, int, int, int, std::mt19937& rng) { return rng() % 1000 == 0; } },
+	{ "noise10", [](int, int, int, int, std::mt19937& rng) { return rng() % 100 < 10; } },
+	{ "noise50", [](int, int, int, int, std::mt19937& rng) { return rng() % 100 < 50; } },
+	{ "noise90", [](int, int, int, int, std::mt19937& rng) { return rng() % 100 < 90; } },
+	{ "blobs", [](int x, int y, int width, int height, std::mt19937&) {
+		const int cell = std::max(16, std::min(width, height) / 4);
+		const int cx = x % cell - cell / 2, cy = y % cell - cell / 2;
+		return cx * cx + cy * cy < cell * cell / 6;
+	} },
+	/* a few small squares, >99% of rows and words empty */
+	{ "islands", [](int x, int y, int, int, std::mt19937&) { return x % 512 < 24 && y % 512 < 24; } },
+	{ "white", [](int, int, int, int, std::mt19937&) { return true; } },
+	/* one pixel wide serpentine: a single component spanning every other row */
+	{ "snake", [](int x, int y, int width, int, std::mt19937&) {
+		if (y % 2 == 0)
+			return true;
+		return (y % 4 == 1) ? x == width - 1 : x == 0;
+	} },
+};
+
+template<typename pixel_t>
+static VSFrame makeMask(const Pattern& pattern, int width, int height, int bits) {
+	VSFrame f = makeFrame<pixel_t>(width, height);
+	const double peak = sizeof(pixel_t) == 4 ? 1.0 : (1 << bits) - 1;
+	std::mt19937 rng(1234);
+	for (int y = 0; y < height; ++y) {
+		pixel_t* row = reinterpret_cast<pixel_t*>(f.plane.data() + f.stride * y);
+		for (int x = 0; x < width; ++x) {
+			row[x] = static_cast<pixel_t>(pattern.fg(x, y, width, height, rng) ? peak : peak * 0.25);
+		}
+	}
+	return f;
+}
+
+struct Options {
+	int width = 1920;
+	int height = 1080;
+	int iters = 5;
+	int threads = 1;
+	const Kernels* kernels = nullptr;
+	std::string filter;
+	bool check = false;
+};
+
+template<typename pixel_t>
+static void runCase(const std::string& name, const Options& opt, int bits, Process_c_Ptr func, const TMCData& d, const VSAPI& api) {
+	for (const auto& pattern : patterns) {
+		const std::string label = name + " " + pattern.name;
+		if (!opt.filter.empty() && label.find(opt.filter) == std::string::npos)
+			continue;
+
+		const VSFrame src = makeMask<pixel_t>(pattern, opt.width, opt.height, bits);
+		const FrameParams params = d.frame_params();
+		VSFrame dst = makeFrame<pixel_t>(opt.width, opt.height);
+		std::chrono::duration<double> elapsed{};
+
+		/* a fresh thread per case so its thread_local scratch is counted */
+		const size_t base = heap_current.load();
+		heap_peak.store(base);
+		std::thread worker([&] {
+			func(&src, &dst, api.getFramePropertiesRW(&dst), 0, bits, &d, params, &api);
+			const auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < opt.iters; ++i) {
+				func(&src, &dst, api.getFramePropertiesRW(&dst), 0, bits, &d, params, &api);
+			}
+			elapsed = std::chrono::steady_clock::now() - start;
+		});
+		worker.join();
+
+		const double mpix = static_cast<double>(opt.width) * opt.height * opt.iters / 1e6;
+		printf("%-48s %10.1f Mpix/s %10.1f KiB\n", label.c_str(), mpix / elapsed.count(), (heap_peak.load() - base) / 1024.0);
+	}
+}
+
+template<bool binarize, bool reverse, typename pixel_t>
+static void runTMC(const Options& opt, int bits, const VSAPI& api) {
+	for (int engine = 0; engine < 2; ++engine) {
+		for (int connectivity : { 4, 8 }) {
+			for (int mode = 0; mode <= 8; ++mode) {
+				TMCData d{};
+				d.length = 16;
+				d.fade = 0;
+				d.threads = opt.threads;
+				d.kernels = opt.kernels;
+				d.directions = connectivity == 4 ? directions4 : directions8;
+				d.dir_count = connectivity;
+				d.set_thresh<pixel_t>(sizeof(pixel_t) == 4 ? static_cast<pixel_t>(0.5f) : static_cast<pixel_t>(1 << (bits - 1)));
+				setProcessFunction<binarize, reverse, pixel_t>(&d, mode, engine);
+				createPool(&d);
+
+				const std::string name = "process_c<" + std::to_string(mode) + "," + (binarize ? "bin" : "raw") + "," + (reverse ? "rev" : "fwd") + "," + std::to_string(bits) + "bit> e" + std::to_string(engine) + " c" + std::to_string(connectivity);
+				runCase<pixel_t>(name, opt, bits, d.process_c_func, d, api);
+			}
+		}
+	}
+}
+
+// Output plane of func, planes it left to the source or to zero included.
+template<typename pixel_t>
+static std::vector<uint8_t> processOutput(Process_c_Ptr func, const VSFrame& src, int bits, const TMCData& d, const VSAPI& api) {
+	VSFrame dst = makeFrame<pixel_t>(src.width, src.height);
+	const PlaneOutput output = func(&src, &dst, api.getFramePropertiesRW(&dst), 0, bits, &d, d.frame_params(), &api);
+	if (output == poSource)
+		return src.plane;
+	if (output == poZero)
+		std::fill(dst.plane.begin(), dst.plane.end(), 0);
+	return dst.plane;
+}
+
+// --check reference: process_c and its helpers as of the baseline commit
+// (5f40540), before either engine was written, kept verbatim. Its one known
+// bug is left in: lookup is resized without clearing when the frame size
+// changes, so stale visited bits from a larger earlier frame skip pixels. Both
+// engines label each frame from scratch and don't share it, and --check uses a
+// single frame size per run, so the reference is never hit by it.
+namespace baseline {
+
+template<typename pixel_t>
+inline bool is_black(pixel_t value, pixel_t thresh) {
+	return value < thresh;
+}
+
+inline bool visited(int x, int y, int width, const std::vector<uint8_t>& lookup) {
+	unsigned int normal_pos = y * width + x;
+	return lookup[normal_pos >> 3] & (1 << (normal_pos & 7));
+}
+
+inline void visit(int x, int y, int width, std::vector<uint8_t>& lookup) {
+	unsigned int normal_pos = y * width + x;
+	lookup[normal_pos >> 3] |= (1 << (normal_pos & 7));
+}
+
+template<int filter_mode, bool binarize, bool reverse, typename pixel_t>
+void process_c(const VSFrame* src, VSFrame* dst, int bits, const TMCData* d, const VSAPI* vsapi) {
+	const pixel_t* srcptr = reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(src, 0));
+	pixel_t* VS_RESTRICT dstptr = reinterpret_cast<pixel_t*>(vsapi->getWritePtr(dst, 0));
+	const int srcStride = vsapi->getStride(src, 0) / sizeof(pixel_t);
+	int height = vsapi->getFrameHeight(src, 0);
+	int width = vsapi->getFrameWidth(src, 0);
+	memset(dstptr, 0, (srcStride * sizeof(pixel_t)) * height);
+
+	thread_local std::vector<uint8_t> lookup;
+	const size_t lookup_size = (height * width + 7) >> 3;
+	if (lookup.size() != lookup_size) {
+		lookup.resize(lookup_size, 0);
+	}
+	else {
+		std::fill(lookup.begin(), lookup.end(), 0);
+	}
+
+	thread_local std::vector<Coordinates> coordinates;
+	thread_local std::vector<Coordinates> white_pixels;
+	coordinates.reserve(4096);
+	white_pixels.reserve(4096);
+
+	const auto peak = (sizeof(pixel_t) != 4) ? (1 << bits) - 1 : 1.0f;
+	const auto& directions = d->directions;
+	const int dir_count = d->dir_count;
+	const pixel_t thresh = d->get_thresh<pixel_t>();
+	const auto length = d->length;
+	const auto fade = d->fade;
+	const double fade_inv = fade > 0 ? 1.0f / fade : 0.0f;
+
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			if (visited(x, y, width, lookup)) continue;
+			if (is_black<pixel_t>(srcptr[srcStride * y + x], thresh)) continue;
+
+			coordinates.clear();
+			white_pixels.clear();
+
+			coordinates.emplace_back(x, y);
+			white_pixels.emplace_back(x, y);
+			visit(x, y, width, lookup);
+
+			int min_x = x, min_y = y, max_x = x, max_y = y;
+			while (!coordinates.empty()) {
+				/* pop last coordinates */
+				Coordinates current = coordinates.back();
+				coordinates.pop_back();
+
+				for (int dir = 0; dir < dir_count; dir++) {
+					const int i = current.first + directions[dir].first;
+					const int j = current.second + directions[dir].second;
+
+					if (i < 0 || i >= width || j < 0 || j >= height) continue;
+					if (visited(i, j, width, lookup)) continue;
+					if (is_black<pixel_t>(srcptr[srcStride * j + i], thresh)) continue;
+
+					coordinates.emplace_back(i, j);
+					white_pixels.emplace_back(i, j);
+					visit(i, j, width, lookup);
+
+					if constexpr (filter_mode == 1) { // centriod_x
+						max_x += i;
+					}
+					else if constexpr (filter_mode == 2) { // centriod_y
+						max_y += j;
+					}
+					else if constexpr (filter_mode == 3) { // min_x
+						min_x = std::min(min_x, i);
+					}
+					else if constexpr (filter_mode == 4) { // min_y
+						min_y = std::min(min_y, j);
+					}
+					else if constexpr (filter_mode == 5) { // max_x
+						max_x = std::max(max_x, i);
+					}
+					else if constexpr (filter_mode == 6) { // max_y
+						max_y = std::max(max_y, j);
+					}
+					else if constexpr (filter_mode == 7) { // width
+						min_x = std::min(min_x, i);
+						max_x = std::max(max_x, i);
+					}
+					else if constexpr (filter_mode == 8) { // height
+						min_y = std::min(min_y, j);
+						max_y = std::max(max_y, j);
+					}
+				}
+			}
+
+			size_t component_value;
+			if constexpr (filter_mode == 0) { // pixel count
+				component_value = white_pixels.size();
+			}
+			else if constexpr (filter_mode == 1) { // centriod_x
+				component_value = max_x / white_pixels.size();
+			}
+			else if constexpr (filter_mode == 2) { // centriod_y
+				component_value = max_y / white_pixels.size();
+			}
+			else if constexpr (filter_mode == 3) { // min_x
+				component_value = min_x;
+			}
+			else if constexpr (filter_mode == 4) { // min_y
+				component_value = min_y;
+			}
+			else if constexpr (filter_mode == 5) { // max_x
+				component_value = max_x;
+			}
+			else if constexpr (filter_mode == 6) { // max_y
+				component_value = max_y;
+			}
+			else if constexpr (filter_mode == 7) { // width
+				component_value = max_x - min_x + 1;
+			}
+			else if constexpr (filter_mode == 8) { // height
+				component_value = max_y - min_y + 1;
+			}
+
+			bool should_draw;
+			double fade_factor = 1.0;
+			if constexpr (!reverse) {
+				should_draw = (component_value >= length);
+				if (should_draw && fade > 0 && (component_value - length <= fade)) {
+					fade_factor = (component_value - length) * fade_inv;
+				}
+			}
+			else {
+				should_draw = (component_value <= length);
+				if (should_draw && fade > 0 && (length - component_value <= fade)) {
+					fade_factor = (length - component_value) * fade_inv;
+				}
+			}
+
+			if (should_draw) {
+				for (const auto& pixel : white_pixels) {
+					const auto pos = srcStride * pixel.second + pixel.first;
+
+					if constexpr (binarize) {
+						dstptr[pos] = peak * fade_factor;
+					}
+					else {
+						dstptr[pos] = srcptr[pos] * fade_factor;
+					}
+				}
+			}
+		}
+	}
+}
+
+} // namespace baseline
+
+typedef void (*Baseline_Ptr)(const VSFrame*, VSFrame*, int, const TMCData*, const VSAPI*);
+
+template<bool binarize, bool reverse, typename pixel_t>
+static Baseline_Ptr baselineFunction(int mode) {
+	switch (mode) {
+	case 0: return &baseline::process_c<0, binarize, reverse, pixel_t>;
+	case 1: return &baseline::process_c<1, binarize, reverse, pixel_t>;
+	case 2: return &baseline::process_c<2, binarize, reverse, pixel_t>;
+	case 3: return &baseline::process_c<3, binarize, reverse, pixel_t>;
+	case 4: return &baseline::process_c<4, binarize, reverse, pixel_t>;
+	case 5: return &baseline::process_c<5, binarize, reverse, pixel_t>;
+	case 6: return &baseline::process_c<6, binarize, reverse, pixel_t>;
+	case 7: return &baseline::process_c<7, binarize, reverse, pixel_t>;
+	default: return &baseline::process_c<8, binarize, reverse, pixel_t>;
+	}
+}
+
+// Rows of two planes of src's size whose pixels differ.
+template<typename pixel_t>
+static int differingRows(const VSFrame& src, const uint8_t* actual, const uint8_t* expected) {
+	int diff = 0;
+	for (int y = 0; y < src.height; ++y) {
+		diff += memcmp(actual + src.stride * y, expected + src.stride * y, src.width * sizeof(pixel_t)) != 0;
+	}
+	return diff;
+}
+
+// --check: engine 0, serial and in strips, engine 1 and ccl_clean against the
+// baseline process_c, pixel for pixel. Returns the number of differing cases.
+template<bool binarize, bool reverse, typename pixel_t>
+static int checkTMC(const Options& opt, int bits, const VSAPI& api) {
+	int failures = 0;
+	for (int connectivity : { 4, 8 }) {
+		for (int mode = 0; mode <= 8; ++mode) {
+			for (unsigned int fade : { 0u, 8u }) {
+				TMCData d[2]{};
+				for (int engine = 0; engine < 2; ++engine) {
+					d[engine].length = 16;
+					d[engine].fade = fade;
+					d[engine].threads = 1;
+					d[engine].kernels = opt.kernels;
+					d[engine].directions = connectivity == 4 ? directions4 : directions8;
+					d[engine].dir_count = connectivity;
+					d[engine].set_thresh<pixel_t>(sizeof(pixel_t) == 4 ? static_cast<pixel_t>(0.5f) : static_cast<pixel_t>(1 << (bits - 1)));
+					setProcessFunction<binarize, reverse, pixel_t>(&d[engine], mode, engine);
+				}
+				d[0].threads = 4;
+				createPool(&d[0]);
+				const Baseline_Ptr reference = baselineFunction<binarize, reverse, pixel_t>(mode);
+
+				for (const auto& pattern : patterns) {
+					const std::string label = "process_c<" + std::to_string(mode) + "," + (binarize ? "bin" : "raw") + "," + (reverse ? "rev" : "fwd") + "," + std::to_string(bits) + "bit> c" + std::to_string(connectivity) + " fade" + std::to_string(fade) + " " + pattern.name;
+					if (!opt.filter.empty() && label.find(opt.filter) == std::string::npos)
+						continue;
+
+					const VSFrame src = makeMask<pixel_t>(pattern, opt.width, opt.height, bits);
+					VSFrame expected = makeFrame<pixel_t>(src.width, src.height);
+					reference(&src, &expected, bits, &d[1], &api);
+
+					auto compare = [&](const std::string& what, const uint8_t* actual) {
+						const int diff = differingRows<pixel_t>(src, actual, expected.plane.data());
+						if (diff) {
+							printf("%-56s %s: %d rows differ\n", label.c_str(), what.c_str(), diff);
+							++failures;
+						}
+					};
+
+					for (int threads : { 1, 4 }) {
+						d[0].threads = threads;
+						compare("e0 t" + std::to_string(threads), processOutput<pixel_t>(d[0].process_c_func, src, bits, d[0], api).data());
+					}
+					compare("e1", processOutput<pixel_t>(d[1].process_c_func, src, bits, d[1], api).data());
+
+					/* the library on its own, as a caller outside VapourSynth would run it */
+					CCLContext ctx;
+					ctx.kernels = opt.kernels;
+					CleanParams p;
+					p.mode = mode;
+					p.length = d[1].length;
+					p.fade = fade;
+					p.reverse = reverse;
+					p.binarize = binarize;
+					p.eight_connected = connectivity == 8;
+					p.threads = 4;
+					VSFrame dst = makeFrame<pixel_t>(src.width, src.height);
+					ccl_clean<pixel_t>(ctx, reinterpret_cast<const pixel_t*>(src.plane.data()), reinterpret_cast<pixel_t*>(dst.plane.data()), src.stride / sizeof(pixel_t), src.width, src.height, bits, d[1].frame_params().get_thresh<pixel_t>(), p);
+					compare("ccl_clean", dst.plane.data());
+				}
+			}
+		}
+	}
+	return failures;
+}
+
+// Values of a stats prop, integer or float.
+static std::vector<double> propValues(const VSMap& props, const std::string& key) {
+	if (auto it = props.ints.find(key); it != props.ints.end())
+		return std::vector<double>(it->second.begin(), it->second.end());
+	if (auto it = props.floats.find(key); it != props.floats.end())
+		return it->second;
+	return {};
+}
+
+// --check: ccl_stats, streamed and in strips, against the props of
+// process_ccls. Returns the number of differing cases.
+template<typename pixel_t>
+static int checkStats(const Options& opt, int bits, const VSAPI& api) {
+	constexpr unsigned all_stats = isSum | isMean | isMin | isMax | isCentroid;
+	int failures = 0;
+	for (int connectivity : { 4, 8 }) {
+		TMCData d{};
+		d.threads = 1;
+		d.kernels = opt.kernels;
+		d.directions = connectivity == 4 ? directions4 : directions8;
+		d.dir_count = connectivity;
+		d.intensity_stats = all_stats;
+		d.set_thresh<pixel_t>(sizeof(pixel_t) == 4 ? static_cast<pixel_t>(0.5f) : static_cast<pixel_t>(1 << (bits - 1)));
+
+		for (const auto& pattern : patterns) {
+			const std::string label = "process_ccls<" + std::to_string(bits) + "bit> c" + std::to_string(connectivity) + " " + pattern.name;
+			if (!opt.filter.empty() && label.find(opt.filter) == std::string::npos)
+				continue;
+
+			VSFrame src = makeMask<pixel_t>(pattern, opt.width, opt.height, bits);
+			process_ccls<pixel_t>(&src, &src, &src.props, 0, bits, &d, d.frame_params(), &api);
+
+			for (int threads : { 1, 4 }) {
+				CCLContext ctx;
+				ctx.kernels = opt.kernels;
+				const size_t num_components = ccl_stats<pixel_t>(ctx, reinterpret_cast<const pixel_t*>(src.plane.data()), src.stride / sizeof(pixel_t), src.width, src.height, d.frame_params().get_thresh<pixel_t>(), connectivity == 8, threads, all_stats);
+
+				/* label 0 is the background, components follow in order */
+				auto stats = [&](size_t i) -> const ComponentStats& { return i == 0 ? ctx.background : ctx.stats()[i - 1]; };
+				auto intensity = [&](size_t i) -> const IntensityStats& { return i == 0 ? ctx.background_intensity : ctx.intensity_stats()[i - 1]; };
+				auto measured = [&](size_t i, double value) {
+					if (stats(i).area == 0)
+						return 0.0;
+					return std::is_floating_point_v<pixel_t> ? value : static_cast<double>(std::llround(value));
+				};
+				const std::pair<const char*, std::function<double(size_t)>> columns[] = {
+					{ "_CCLStatAreas", [&](size_t i) { return static_cast<double>(stats(i).area); } },
+					{ "_CCLStatLefts", [&](size_t i) { return static_cast<double>(stats(i).min_x); } },
+					{ "_CCLStatTops", [&](size_t i) { return static_cast<double>(stats(i).min_y); } },
+					{ "_CCLStatWidths", [&](size_t i) { return static_cast<double>(stats(i).max_x - stats(i).min_x + 1); } },
+					{ "_CCLStatHeights", [&](size_t i) { return static_cast<double>(stats(i).max_y - stats(i).min_y + 1); } },
+					{ "_CCLStatSums", [&](size_t i) { return measured(i, intensity(i).sum); } },
+					{ "_CCLStatMin", [&](size_t i) { return measured(i, intensity(i).min); } },
+					{ "_CCLStatMax", [&](size_t i) { return measured(i, intensity(i).max); } },
+				};
+
+				for (const auto& column : columns) {
+					const std::vector<double> expected = propValues(src.props, column.first);
+					size_t diff = expected.size() != num_components + 1;
+					for (size_t i = 0; !diff && i < expected.size(); ++i) {
+						diff += column.second(i) != expected[i];
+					}
+					if (diff) {
+						printf("%-56s t%d: %s differ\n", label.c_str(), threads, column.first);
+						++failures;
+					}
+				}
+			}
+		}
+	}
+	return failures;
+}
+
+template<typename pixel_t>
+static int checkType(const Options& opt, int bits, const VSAPI& api) {
+	return checkTMC<false, false, pixel_t>(opt, bits, api) + checkTMC<false, true, pixel_t>(opt, bits, api) +
+		checkTMC<true, false, pixel_t>(opt, bits, api) + checkTMC<true, true, pixel_t>(opt, bits, api) +
+		checkStats<pixel_t>(opt, bits, api);
+}
+
+template<typename pixel_t>
+static void runType(const Options& opt, int bits, const VSAPI& api) {
+	runTMC<false, false, pixel_t>(opt, bits, api);
+	runTMC<false, true, pixel_t>(opt, bits, api);
+	runTMC<true, false, pixel_t>(opt, bits, api);
+	runTMC<true, true, pixel_t>(opt, bits, api);
+
+	for (int connectivity : { 4, 8 }) {
+		for (unsigned intensity_stats : { 0u, isSum | isMean | isMin | isMax | isCentroid }) {
+			TMCData d{};
+			d.threads = opt.threads;
+			d.kernels = opt.kernels;
+			d.directions = connectivity == 4 ? directions4 : directions8;
+			d.dir_count = connectivity;
+			d.intensity_stats = intensity_stats;
+			d.set_thresh<pixel_t>(sizeof(pixel_t) == 4 ? static_cast<pixel_t>(0.5f) : static_cast<pixel_t>(1 << (bits - 1)));
+			createPool(&d);
+			const std::string name = "process_ccls<" + std::to_string(bits) + "bit> c" + std::to_string(connectivity) + (intensity_stats ? " stats" : "");
+			runCase<pixel_t>(name, opt, bits, &process_ccls<pixel_t>, d, api);
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	Options opt;
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		if (arg == "--size" && i + 1 < argc) {
+			if (sscanf(argv[++i], "%dx%d", &opt.width, &opt.height) != 2 || opt.width <= 0 || opt.height <= 0) {
+				fprintf(stderr, "invalid --size\n");
+				return 1;
+			}
+		}
+		else if (arg == "--iters" && i + 1 < argc) {
+			opt.iters = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--threads" && i + 1 < argc) {
+			opt.threads = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--opt" && i + 1 < argc) {
+			opt.kernels = select_kernels(atoi(argv[++i]));
+			if (!opt.kernels) {
+				fprintf(stderr, "--opt level not supported by this CPU\n");
+				return 1;
+			}
+		}
+		else if (arg == "--filter" && i + 1 < argc) {
+			opt.filter = argv[++i];
+		}
+		else if (arg == "--check") {
+			opt.check = true;
+		}
+		else {
+			fprintf(stderr, "usage: %s [--size WxH] [--iters N] [--threads N] [--opt N] [--filter substring] [--check]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (!opt.kernels)
+		opt.kernels = select_kernels(-1);
+
+	const VSAPI api = makeStubApi();
+	if (opt.check) {
+		printf("%dx%d, %s kernels, engines and library against the baseline\n", opt.width, opt.height, opt.kernels->name);
+		const int failures = checkType<uint8_t>(opt, 8, api) + checkType<uint16_t>(opt, 16, api) + checkType<float>(opt, 32, api);
+		printf("%d differing case(s)\n", failures);
+		return failures ? 1 : 0;
+	}
+
+	printf("%dx%d, %d iterations, %d thread(s), %s kernels\n", opt.width, opt.height, opt.iters, opt.threads, opt.kernels->name);
+	runType<uint8_t>(opt, 8, api);
+	runType<uint16_t>(opt, 16, api);
+	runType<float>(opt, 32, api);
+	return 0;
+}